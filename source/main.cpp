@@ -3,9 +3,28 @@
 #include <algorithm>
 #include <cstdint>
 #include <map>
+#include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <fstream>
+#include <string>
+#include <sstream>
+#include <random>
+#include <cstring>
 #include <vector>
+#include <variant>
+#include <thread>
+#include <chrono>
+#include <mutex>
 #include <SDL2/SDL.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SYNTH_SIMD 1
+#else
+#define SYNTH_SIMD 0
+#endif
+
 using namespace std;
 #define FTYPE double
 
@@ -20,6 +39,736 @@ namespace synth
 		return dHertz * 2.0 * M_PI;
 	}
 
+	// Audio is rendered in blocks of at most BLOCK_SIZE samples at SAMPLE_RATE
+	const FTYPE SAMPLE_RATE = 44100.0;
+	const int BLOCK_SIZE = 256;
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Vectorised sine
+
+	// sin(2 * pi * x) for x in cycles, valid for |x| < 2^51. x is reduced to
+	// [-0.5, 0.5] by rounding, folded onto [0, 0.25] using the symmetry of sine,
+	// and evaluated with the degree 15 Taylor polynomial on [0, pi/2]. The
+	// truncation error is below (pi/2)^17 / 17! ~= 6.1e-12 (6.0e-12 measured
+	// against libm). The reduction is exact, so the error does not grow with x.
+	const FTYPE SINE_ROUND = 6755399441055744.0;	// 1.5 * 2^52, adding and subtracting rounds to integer
+	const FTYPE SINE_C3 = -1.0 / 6.0;
+	const FTYPE SINE_C5 = 1.0 / 120.0;
+	const FTYPE SINE_C7 = -1.0 / 5040.0;
+	const FTYPE SINE_C9 = 1.0 / 362880.0;
+	const FTYPE SINE_C11 = -1.0 / 39916800.0;
+	const FTYPE SINE_C13 = 1.0 / 6227020800.0;
+	const FTYPE SINE_C15 = -1.0 / 1307674368000.0;
+
+	// Rounds a phase in cycles to the nearest whole cycle, valid for |x| < 2^51
+	FTYPE round_cycles(const FTYPE x)
+	{
+		return (x + SINE_ROUND) - SINE_ROUND;
+	}
+
+	FTYPE sin_cycles(const FTYPE x)
+	{
+		FTYPE r = x - round_cycles(x);
+		FTYPE a = fabs(r);
+		FTYPE z = w(min(a, 0.5 - a));
+		FTYPE z2 = z * z;
+		FTYPE p = z * (1.0 + z2 * (SINE_C3 + z2 * (SINE_C5 + z2 * (SINE_C7 + z2 * (SINE_C9
+			+ z2 * (SINE_C11 + z2 * (SINE_C13 + z2 * SINE_C15)))))));
+		return r < 0.0 ? -p : p;
+	}
+
+	void sine_scalar(const FTYPE *pCycles, FTYPE *pOutput, const int nSamples)
+	{
+		for (int i = 0; i < nSamples; i++)
+			pOutput[i] = sin_cycles(pCycles[i]);
+	}
+
+#if SYNTH_SIMD
+	// The SIMD kernels assume FTYPE is double: 2 lanes with SSE2, 4 with AVX2
+	__attribute__((target("sse2")))
+	void sine_sse2(const FTYPE *pCycles, FTYPE *pOutput, const int nSamples)
+	{
+		const __m128d vRound = _mm_set1_pd(SINE_ROUND);
+		const __m128d vSign = _mm_set1_pd(-0.0);
+		const __m128d vHalf = _mm_set1_pd(0.5);
+		const __m128d vTwoPi = _mm_set1_pd(2.0 * M_PI);
+
+		int i = 0;
+		for (; i + 2 <= nSamples; i += 2)
+		{
+			__m128d x = _mm_loadu_pd(pCycles + i);
+			__m128d r = _mm_sub_pd(x, _mm_sub_pd(_mm_add_pd(x, vRound), vRound));
+			__m128d s = _mm_and_pd(r, vSign);
+			__m128d a = _mm_andnot_pd(vSign, r);
+			__m128d z = _mm_mul_pd(_mm_min_pd(a, _mm_sub_pd(vHalf, a)), vTwoPi);
+			__m128d z2 = _mm_mul_pd(z, z);
+			__m128d p = _mm_set1_pd(SINE_C15);
+			p = _mm_add_pd(_mm_mul_pd(p, z2), _mm_set1_pd(SINE_C13));
+			p = _mm_add_pd(_mm_mul_pd(p, z2), _mm_set1_pd(SINE_C11));
+			p = _mm_add_pd(_mm_mul_pd(p, z2), _mm_set1_pd(SINE_C9));
+			p = _mm_add_pd(_mm_mul_pd(p, z2), _mm_set1_pd(SINE_C7));
+			p = _mm_add_pd(_mm_mul_pd(p, z2), _mm_set1_pd(SINE_C5));
+			p = _mm_add_pd(_mm_mul_pd(p, z2), _mm_set1_pd(SINE_C3));
+			p = _mm_add_pd(_mm_mul_pd(p, z2), _mm_set1_pd(1.0));
+			_mm_storeu_pd(pOutput + i, _mm_xor_pd(_mm_mul_pd(p, z), s));
+		}
+		sine_scalar(pCycles + i, pOutput + i, nSamples - i);
+	}
+
+	__attribute__((target("avx2")))
+	void sine_avx2(const FTYPE *pCycles, FTYPE *pOutput, const int nSamples)
+	{
+		const __m256d vRound = _mm256_set1_pd(SINE_ROUND);
+		const __m256d vSign = _mm256_set1_pd(-0.0);
+		const __m256d vHalf = _mm256_set1_pd(0.5);
+		const __m256d vTwoPi = _mm256_set1_pd(2.0 * M_PI);
+
+		int i = 0;
+		for (; i + 4 <= nSamples; i += 4)
+		{
+			__m256d x = _mm256_loadu_pd(pCycles + i);
+			__m256d r = _mm256_sub_pd(x, _mm256_sub_pd(_mm256_add_pd(x, vRound), vRound));
+			__m256d s = _mm256_and_pd(r, vSign);
+			__m256d a = _mm256_andnot_pd(vSign, r);
+			__m256d z = _mm256_mul_pd(_mm256_min_pd(a, _mm256_sub_pd(vHalf, a)), vTwoPi);
+			__m256d z2 = _mm256_mul_pd(z, z);
+			__m256d p = _mm256_set1_pd(SINE_C15);
+			p = _mm256_add_pd(_mm256_mul_pd(p, z2), _mm256_set1_pd(SINE_C13));
+			p = _mm256_add_pd(_mm256_mul_pd(p, z2), _mm256_set1_pd(SINE_C11));
+			p = _mm256_add_pd(_mm256_mul_pd(p, z2), _mm256_set1_pd(SINE_C9));
+			p = _mm256_add_pd(_mm256_mul_pd(p, z2), _mm256_set1_pd(SINE_C7));
+			p = _mm256_add_pd(_mm256_mul_pd(p, z2), _mm256_set1_pd(SINE_C5));
+			p = _mm256_add_pd(_mm256_mul_pd(p, z2), _mm256_set1_pd(SINE_C3));
+			p = _mm256_add_pd(_mm256_mul_pd(p, z2), _mm256_set1_pd(1.0));
+			_mm256_storeu_pd(pOutput + i, _mm256_xor_pd(_mm256_mul_pd(p, z), s));
+		}
+		sine_scalar(pCycles + i, pOutput + i, nSamples - i);
+	}
+#endif
+
+	typedef void (*sine_kernel)(const FTYPE *pCycles, FTYPE *pOutput, const int nSamples);
+
+	// Picks the widest kernel the CPU supports
+	sine_kernel select_sine_kernel()
+	{
+#if SYNTH_SIMD
+		if (SDL_HasAVX2()) return sine_avx2;
+		if (SDL_HasSSE2()) return sine_sse2;
+#endif
+		return sine_scalar;
+	}
+
+	// Writes sin(2 * pi * pCycles[i]) to pOutput[i] for a block of samples
+	void sine(const FTYPE *pCycles, FTYPE *pOutput, const int nSamples)
+	{
+		static const sine_kernel kernel = select_sine_kernel();
+		kernel(pCycles, pOutput, nSamples);
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Oscillator waveforms
+	const int OSC_SINE = 0;
+	const int OSC_SQUARE = 1;
+	const int OSC_TRIANGLE = 2;
+	const int OSC_SAW_ANA = 3;
+	const int OSC_SAW_DIG = 4;
+	const int OSC_NOISE = 5;
+	const int OSC_PULSE = 6;	// dCustom is the duty cycle in percent
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Band-limited wavetables
+
+	const int WAVETABLE_SIZE = 2048;
+	const int WAVETABLE_LEVELS = 12;		// One per octave
+	const FTYPE WAVETABLE_BASE_HERTZ = 8.0;	// Top of the lowest octave, scale(0)
+
+	// One cycle of a waveform stored once per octave. Each level holds only the
+	// partials that stay below Nyquist for every frequency in its octave, so a
+	// lookup never aliases and costs two reads and a linear interpolation.
+	struct wavetable
+	{
+		vector<FTYPE> vecLevels[WAVETABLE_LEVELS];
+
+		// Builds the levels from at most nMaxPartials partials, partial n having amplitude fPartial(n)
+		wavetable(const int nMaxPartials, FTYPE (*fPartial)(const int))
+		{
+			int nPrevPartials = -1;
+			FTYPE dTopHertz = WAVETABLE_BASE_HERTZ;
+
+			for (int k = 0; k < WAVETABLE_LEVELS; k++, dTopHertz *= 2.0)
+			{
+				int nPartials = min(nMaxPartials, max(1, (int)(SAMPLE_RATE / 2.0 / dTopHertz)));
+
+				// Low octaves are usually capped by nMaxPartials and come out identical
+				if (nPartials == nPrevPartials)
+				{
+					vecLevels[k] = vecLevels[k - 1];
+					continue;
+				}
+
+				vecLevels[k].assign(WAVETABLE_SIZE + 2, 0.0);
+				for (int n = 1; n <= nPartials; n++)
+				{
+					FTYPE dPartial = fPartial(n);
+					for (int i = 0; i < WAVETABLE_SIZE; i++)
+						vecLevels[k][i] += dPartial * sin(w(n) * i / WAVETABLE_SIZE);
+				}
+				// Guard points so a phase that rounds up to 1.0 still interpolates
+				vecLevels[k][WAVETABLE_SIZE] = vecLevels[k][0];
+				vecLevels[k][WAVETABLE_SIZE + 1] = vecLevels[k][1];
+				nPrevPartials = nPartials;
+			}
+		}
+
+		// Returns the level to use for fundamentals up to dHertz
+		const FTYPE *level(const FTYPE dHertz) const
+		{
+			int k = 0;
+			for (FTYPE dTopHertz = WAVETABLE_BASE_HERTZ; k < WAVETABLE_LEVELS - 1 && fabs(dHertz) > dTopHertz; dTopHertz *= 2.0)
+				k++;
+			return vecLevels[k].data();
+		}
+
+		// Reads a level at dPhase in [0,1]
+		static FTYPE lookup(const FTYPE *pLevel, const FTYPE dPhase)
+		{
+			FTYPE dIndex = dPhase * WAVETABLE_SIZE;
+			int i = (int)dIndex;
+			return pLevel[i] + (dIndex - i) * (pLevel[i + 1] - pLevel[i]);
+		}
+	};
+
+	// Analogue saw: partial n at 1/n, scaled so the full series spans -1 to +1
+	FTYPE saw_partial(const int n)
+	{
+		return (2.0 / M_PI) / n;
+	}
+
+	// Returns the saw wavetable with nPartials partials, building it on first use.
+	// Instruments should look theirs up front and hand it to their oscillators,
+	// so rendering never takes the lock or builds a table.
+	const wavetable &saw_table(const int nPartials)
+	{
+		static map<int, wavetable> mapTables;
+		static mutex mtxTables;		// Instruments may be set up on any thread
+
+		lock_guard<mutex> lock(mtxTables);
+		auto t = mapTables.find(nPartials);
+		if (t == mapTables.end())
+			t = mapTables.emplace(nPartials, wavetable(nPartials, saw_partial)).first;
+		return t->second;
+	}
+
+	// Number of partials the analogue saw has for a given dCustom, those below it
+	int saw_partials(const FTYPE dCustom)
+	{
+		return max(1, (int)ceil(dCustom) - 1);
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Noise
+
+	const int NOISE_LANES = 4;
+
+	// splitmix64 step, used to spread seeds over the generator state
+	uint64_t splitmix(uint64_t &nState)
+	{
+		uint64_t z = (nState += 0x9E3779B97F4A7C15ull);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
+	}
+
+	// Base seed that every generator's seed is derived from, together with its
+	// index. Random by default; fix it with seed_noise() before an offline render
+	// to make the output bit-reproducible. New voices take the next index from a
+	// running count on the audio thread, so the streams do not depend on what
+	// the render threads construct or in which order.
+	uint64_t nNoiseSeed = random_device()() | ((uint64_t)random_device()() << 32);
+	uint64_t nNoiseCount = 0;
+
+	void seed_noise(const uint64_t nSeed)
+	{
+		nNoiseSeed = nSeed;
+		nNoiseCount = 0;
+	}
+
+	// White noise from NOISE_LANES interleaved xorshift64 generators. Only shifts,
+	// xors and bit casts are used, so fill() vectorises across the lanes.
+	struct noise_generator
+	{
+		uint64_t nState[NOISE_LANES];
+
+		// Generator nIndex of the base seed
+		explicit noise_generator(const uint64_t nIndex = 0)
+		{
+			uint64_t nSeed = nNoiseSeed + nIndex * 0xD1B54A32D192ED03ull;
+			for (int j = 0; j < NOISE_LANES; j++)
+				do nState[j] = splitmix(nSeed); while (nState[j] == 0);
+		}
+
+		// Writes nSamples (<= BLOCK_SIZE) of noise between -1 and +1
+		void fill(FTYPE *pOutput, const int nSamples)
+		{
+			uint64_t nBits[BLOCK_SIZE];
+			uint64_t s[NOISE_LANES];
+			memcpy(s, nState, sizeof(s));
+
+			// Whole groups of lanes only; a partial last group just skips a few values
+			for (int i = 0; i < nSamples; i += NOISE_LANES)
+				for (int j = 0; j < NOISE_LANES; j++)
+				{
+					s[j] ^= s[j] << 13;
+					s[j] ^= s[j] >> 7;
+					s[j] ^= s[j] << 17;
+
+					// Top 52 bits as the mantissa of a double in [1,2)
+					nBits[i + j] = 0x3FF0000000000000ull | (s[j] >> 12);
+				}
+
+			memcpy(nState, s, sizeof(s));
+			memcpy(pOutput, nBits, nSamples * sizeof(FTYPE));
+			for (int i = 0; i < nSamples; i++)
+				pOutput[i] = 2.0 * pOutput[i] - 3.0;
+		}
+	};
+
+	// The next generator of the running count, for a new voice
+	noise_generator next_noise()
+	{
+		return noise_generator(++nNoiseCount);
+	}
+
+	// Fractional part of a phase in cycles, in [0,1]
+	FTYPE frac(const FTYPE x)
+	{
+		FTYPE f = x - round_cycles(x);
+		return f < 0.0 ? f + 1.0 : f;
+	}
+
+	// Wraps a phase that moved by less than one cycle back into [0,1)
+	FTYPE wrap(FTYPE dPhase)
+	{
+		if (dPhase >= 1.0) return dPhase - 1.0;
+		if (dPhase < 0.0) return dPhase + 1.0;
+		return dPhase;
+	}
+
+	// PolyBLEP residual for a unit step at phase 0, where t is the phase in [0,1)
+	// and dt the phase increment per sample. Subtracting it from a naive edge
+	// rounds the discontinuity off over one sample either side, which removes
+	// most of the aliasing at the cost of a few multiplies.
+	FTYPE poly_blep(FTYPE t, const FTYPE dt)
+	{
+		if (t < dt)
+		{
+			t /= dt;
+			return t + t - t * t - 1.0;
+		}
+		if (t > 1.0 - dt)
+		{
+			t = (t - 1.0) / dt;
+			return t * t + t + t + 1.0;
+		}
+		return 0.0;
+	}
+
+	// Band-limited pulse between -1 and +1, high for the first dWidth of the cycle
+	FTYPE blep_pulse(const FTYPE t, const FTYPE dt, const FTYPE dWidth)
+	{
+		FTYPE dFall = t + 1.0 - dWidth;
+		if (dFall >= 1.0) dFall -= 1.0;
+		return (t < dWidth ? 1.0 : -1.0) + poly_blep(t, dt) - poly_blep(dFall, dt);
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	// LFOs
+
+	const int LFO_RATE = 32;	// Samples between control-rate LFO evaluations
+
+	// Writes nSamples of a sine LFO starting at dPhase (cycles), and advances dPhase.
+	// The sine is evaluated every LFO_RATE samples and linearly interpolated in
+	// between, which for LFO rates of a few Hz is indistinguishable from per-sample.
+	void lfo_block(FTYPE &dPhase, const FTYPE dHertz, FTYPE *pOutput, const int nSamples)
+	{
+		FTYPE dPoints[BLOCK_SIZE / LFO_RATE + 2];
+		const int nPoints = (nSamples + LFO_RATE - 1) / LFO_RATE + 1;
+		const FTYPE dIncrement = dHertz / SAMPLE_RATE;
+
+		for (int k = 0; k < nPoints; k++)
+			dPoints[k] = dPhase + k * LFO_RATE * dIncrement;
+		sine(dPoints, dPoints, nPoints);
+
+		for (int i = 0; i < nSamples; i++)
+		{
+			int k = i / LFO_RATE;
+			FTYPE f = (FTYPE)(i % LFO_RATE) / LFO_RATE;
+			pOutput[i] = dPoints[k] + f * (dPoints[k + 1] - dPoints[k]);
+		}
+
+		dPhase = frac(dPhase + nSamples * dIncrement);
+	}
+
+	// A modulation source rendered once per block and read by any number of
+	// oscillators, so partials sharing a vibrato do not each evaluate it
+	struct lfo
+	{
+		FTYPE dHertz;
+		FTYPE dPhase;				// Position in cycle [0,1)
+		FTYPE dValue[BLOCK_SIZE];	// Output of the last render(), between -1 and +1
+
+		lfo(const FTYPE hertz = 0.0)
+		{
+			dHertz = hertz;
+			dPhase = 0.0;
+		}
+
+		// Renders the next nSamples at hertz and returns them
+		const FTYPE *render(const FTYPE hertz, const int nSamples)
+		{
+			dHertz = hertz;
+			lfo_block(dPhase, dHertz, dValue, nSamples);
+			return dValue;
+		}
+	};
+
+	// Block oscillator
+	// Renders a run of samples of one waveform. The waveform switch and LFO depth
+	// are resolved once per block instead of once per sample. Phase is kept in
+	// cycles [0,1) and advanced by dHertz / SAMPLE_RATE per sample, so precision
+	// and cost do not depend on how long the engine has been running, and
+	// frequency changes never make the phase jump.
+	struct oscillator
+	{
+		int nType;
+		FTYPE dHertz;			// Current frequency
+		FTYPE dLFOHertz;
+		FTYPE dLFOAmplitude;
+		FTYPE dCustom;
+		FTYPE dPhase;			// Position in cycle [0,1)
+		FTYPE dLFOPhase;		// Position in LFO cycle [0,1)
+		FTYPE dTargetHertz;		// Frequency dHertz is gliding towards
+		FTYPE dGlideStep;		// Change of dHertz per sample while gliding
+		int nGlideSamples;		// Samples left until dHertz reaches dTargetHertz
+		noise_generator noise;	// Per-oscillator state for OSC_NOISE
+		const wavetable *pTable;	// For OSC_SAW_ANA, or null to look it up by dCustom
+
+		oscillator(const FTYPE hertz = 0.0, const int type = OSC_SINE,
+			const FTYPE lfoHertz = 0.0, const FTYPE lfoAmplitude = 0.0, const FTYPE custom = 50.0)
+		{
+			nType = type;
+			dHertz = hertz;
+			dLFOHertz = lfoHertz;
+			dLFOAmplitude = lfoAmplitude;
+			dCustom = custom;
+			dPhase = 0.0;
+			dLFOPhase = 0.0;
+			dTargetHertz = hertz;
+			dGlideStep = 0.0;
+			nGlideSamples = 0;
+			pTable = nullptr;
+		}
+
+		// Changes waveform and frequency, keeping the phase
+		oscillator &set(const FTYPE hertz, const int type = OSC_SINE,
+			const FTYPE lfoHertz = 0.0, const FTYPE lfoAmplitude = 0.0, const FTYPE custom = 50.0)
+		{
+			nType = type;
+			return tune(hertz, lfoHertz, lfoAmplitude, custom);
+		}
+
+		// Changes frequency, LFO and custom parameter, keeping waveform and phase.
+		// Setting the frequency the oscillator is already at or gliding towards has no effect.
+		oscillator &tune(const FTYPE hertz, const FTYPE lfoHertz = 0.0, const FTYPE lfoAmplitude = 0.0, const FTYPE custom = 50.0)
+		{
+			dLFOHertz = lfoHertz;
+			dLFOAmplitude = lfoAmplitude;
+			if (custom != dCustom)
+				pTable = nullptr;
+			dCustom = custom;
+			frequency(hertz);
+			return *this;
+		}
+
+		// Moves to dNewHertz linearly over dGlideTime seconds, or at once if 0 (pitch bend)
+		void frequency(const FTYPE dNewHertz, const FTYPE dGlideTime = 0.0)
+		{
+			if (dNewHertz == dTargetHertz)
+				return;
+
+			dTargetHertz = dNewHertz;
+			nGlideSamples = (int)(dGlideTime * SAMPLE_RATE);
+
+			if (nGlideSamples > 0)
+				dGlideStep = (dTargetHertz - dHertz) / nGlideSamples;
+			else
+				dHertz = dTargetHertz;
+		}
+
+		// Adds dAmplitude * waveform TYPE to the next nSamples (<= BLOCK_SIZE) samples
+		// of pOutput. With the waveform known at compile time each variant is its own
+		// straight-line loop the compiler can inline and vectorise; nType is ignored.
+		// If pLFO is given, that block of LFO values modulates the phase with dDepth in
+		// place of the oscillator's own LFO.
+		template<int TYPE>
+		void render(FTYPE *pOutput, const int nSamples, const FTYPE dAmplitude = 1.0,
+			const FTYPE *pLFO = nullptr, const FTYPE dDepth = 0.0)
+		{
+			if (nSamples <= 0)
+				return;
+
+			FTYPE dWave[BLOCK_SIZE];
+
+			// Noise has no phase to keep
+			if constexpr (TYPE == OSC_NOISE)
+			{
+				noise.fill(dWave, nSamples);
+				for (int i = 0; i < nSamples; i++)
+					pOutput[i] += dAmplitude * dWave[i];
+				return;
+			}
+
+			FTYPE dCycle[BLOCK_SIZE];	// Phase in cycles [0,1)
+			FTYPE dMod[BLOCK_SIZE];		// Phase in cycles, including LFO modulation
+			FTYPE dStep[BLOCK_SIZE];	// Phase increment in cycles, for band-limiting
+			const FTYPE dTopHertz = max(fabs(dHertz), nGlideSamples > 0 ? fabs(dTargetHertz) : 0.0);
+
+			for (int i = 0; i < nSamples; i++)
+			{
+				dCycle[i] = dPhase;
+				dStep[i] = dHertz / SAMPLE_RATE;
+
+				if (nGlideSamples > 0)
+					dHertz = --nGlideSamples > 0 ? dHertz + dGlideStep : dTargetHertz;
+
+				dPhase = wrap(dPhase + dHertz / SAMPLE_RATE);
+			}
+
+			FTYPE dLFODepth = dDepth;
+			if (pLFO == nullptr && dLFOAmplitude != 0.0 && dLFOHertz != 0.0)
+			{
+				lfo_block(dLFOPhase, dLFOHertz, dMod, nSamples);
+				pLFO = dMod;
+				dLFODepth = dLFOAmplitude;
+			}
+
+			// The LFO modulates phase by dLFODepth * dHertz radians at its peak
+			const bool bLFO = pLFO != nullptr && dLFODepth != 0.0;
+			if (bLFO)
+				for (int i = 0; i < nSamples; i++)
+					dMod[i] = dCycle[i] + pLFO[i] * dLFODepth * dStep[i] * (SAMPLE_RATE / (2.0 * M_PI));
+			const FTYPE *pMod = bLFO ? dMod : dCycle;
+
+			if constexpr (TYPE == OSC_SINE)
+			{
+				sine(pMod, dWave, nSamples);
+				for (int i = 0; i < nSamples; i++)
+					pOutput[i] += dAmplitude * dWave[i];
+			}
+			else if constexpr (TYPE == OSC_SQUARE || TYPE == OSC_PULSE)
+			{
+				const FTYPE dWidth = TYPE == OSC_SQUARE ? 0.5 : min(max(dCustom / 100.0, 0.01), 0.99);
+				for (int i = 0; i < nSamples; i++)
+					pOutput[i] += dAmplitude * blep_pulse(frac(pMod[i]), fabs(dStep[i]), dWidth);
+			}
+			else if constexpr (TYPE == OSC_TRIANGLE) // asin(sin(x)) * 2 / pi folded directly from the phase
+			{
+				for (int i = 0; i < nSamples; i++)
+				{
+					FTYPE r = pMod[i] - round_cycles(pMod[i]);
+					FTYPE a = fabs(r);
+					FTYPE t = 4.0 * min(a, 0.5 - a);
+					pOutput[i] += dAmplitude * (r < 0.0 ? -t : t);
+				}
+			}
+			else if constexpr (TYPE == OSC_SAW_ANA) // Partials below dCustom, minus those above Nyquist
+			{
+				const FTYPE *pLevel = (pTable ? *pTable : saw_table(saw_partials(dCustom))).level(dTopHertz);
+				for (int i = 0; i < nSamples; i++)
+					pOutput[i] += dAmplitude * wavetable::lookup(pLevel, frac(pMod[i]));
+			}
+			else if constexpr (TYPE == OSC_SAW_DIG)
+			{
+				for (int i = 0; i < nSamples; i++)
+					pOutput[i] += dAmplitude * (2.0 * dCycle[i] - 1.0 - poly_blep(dCycle[i], fabs(dStep[i])));
+			}
+		}
+
+		// Same as render<TYPE> with the waveform chosen by nType at runtime, for
+		// oscillators set up from data rather than code
+		void render(FTYPE *pOutput, const int nSamples, const FTYPE dAmplitude = 1.0,
+			const FTYPE *pLFO = nullptr, const FTYPE dDepth = 0.0)
+		{
+			switch (nType)
+			{
+			case OSC_SINE: render<OSC_SINE>(pOutput, nSamples, dAmplitude, pLFO, dDepth); break;
+			case OSC_SQUARE: render<OSC_SQUARE>(pOutput, nSamples, dAmplitude, pLFO, dDepth); break;
+			case OSC_TRIANGLE: render<OSC_TRIANGLE>(pOutput, nSamples, dAmplitude, pLFO, dDepth); break;
+			case OSC_SAW_ANA: render<OSC_SAW_ANA>(pOutput, nSamples, dAmplitude, pLFO, dDepth); break;
+			case OSC_SAW_DIG: render<OSC_SAW_DIG>(pOutput, nSamples, dAmplitude, pLFO, dDepth); break;
+			case OSC_NOISE: render<OSC_NOISE>(pOutput, nSamples, dAmplitude, pLFO, dDepth); break;
+			case OSC_PULSE: render<OSC_PULSE>(pOutput, nSamples, dAmplitude, pLFO, dDepth); break;
+			default: break;
+			}
+		}
+	};
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Additive sine bank
+
+	const int ROTATOR_LANES = 4;	// Consecutive samples each partial computes at once
+
+	// Fixed-frequency sine partials generated by complex rotation. Each partial
+	// is a unit phasor multiplied by e^(i w) every sample, so a sample costs one
+	// complex multiply and no sin(). The arrays are laid out as structure of
+	// arrays, and each partial advances ROTATOR_LANES consecutive samples at once
+	// by e^(i w ROTATOR_LANES), so the inner loop vectorises across samples.
+	// Phasors are renormalised every block so rounding cannot make them grow or
+	// decay.
+	//
+	// Each partial adds into an output of its own, so a bank can serve several
+	// voices at once. The voice pool does not use that: every voice owns a bank
+	// of NOTE_PARTIALS, because a voice's partials go through its own envelope
+	// and render in blocks counted from its own note on. Sharing a bank would
+	// not widen the vector loop either, which runs along the samples of one
+	// partial.
+	template<int PARTIALS>
+	struct sine_bank
+	{
+		int nPartials;
+		FTYPE dRe[PARTIALS];		// Phasor, sin(phase) is the imaginary part
+		FTYPE dIm[PARTIALS];
+		FTYPE dCos[PARTIALS];		// Rotation per sample
+		FTYPE dSin[PARTIALS];
+		FTYPE dCosLanes[PARTIALS];	// Rotation per ROTATOR_LANES samples
+		FTYPE dSinLanes[PARTIALS];
+		FTYPE dHertz[PARTIALS];
+		FTYPE dAmplitude[PARTIALS];
+		int nOutput[PARTIALS];		// Which output buffer the partial adds into
+
+		sine_bank()
+		{
+			nPartials = 0;
+		}
+
+		// Sets partial p, adding partials up to p if needed. New partials start at
+		// phase 0; retuning an existing one keeps its phase.
+		void set(const int p, const FTYPE hertz, const FTYPE amplitude, const int output = 0)
+		{
+			for (; nPartials <= p; nPartials++)
+			{
+				dRe[nPartials] = 1.0;
+				dIm[nPartials] = 0.0;
+				dHertz[nPartials] = -1.0;
+			}
+
+			if (dHertz[p] != hertz)
+			{
+				dHertz[p] = hertz;
+				dCos[p] = cos(w(hertz) / SAMPLE_RATE);
+				dSin[p] = sin(w(hertz) / SAMPLE_RATE);
+				dCosLanes[p] = cos(w(hertz) * ROTATOR_LANES / SAMPLE_RATE);
+				dSinLanes[p] = sin(w(hertz) * ROTATOR_LANES / SAMPLE_RATE);
+			}
+			dAmplitude[p] = amplitude;
+			nOutput[p] = output;
+		}
+
+		// Adds nSamples of every partial to ppOutput[nOutput[p]]
+		void render(FTYPE *const *ppOutput, const int nSamples)
+		{
+			const int nWhole = nSamples - nSamples % ROTATOR_LANES;
+
+			for (int p = 0; p < nPartials; p++)
+			{
+				FTYPE *pOutput = ppOutput[nOutput[p]];
+				const FTYPE c = dCos[p], s = dSin[p];
+				const FTYPE cl = dCosLanes[p], sl = dSinLanes[p];
+				const FTYPE a = dAmplitude[p];
+
+				// Lane k holds the phasor k samples ahead
+				FTYPE re[ROTATOR_LANES], im[ROTATOR_LANES];
+				re[0] = dRe[p];
+				im[0] = dIm[p];
+				for (int k = 1; k < ROTATOR_LANES; k++)
+				{
+					re[k] = re[k - 1] * c - im[k - 1] * s;
+					im[k] = re[k - 1] * s + im[k - 1] * c;
+				}
+
+				for (int i = 0; i < nWhole; i += ROTATOR_LANES)
+					for (int k = 0; k < ROTATOR_LANES; k++)
+					{
+						pOutput[i + k] += a * im[k];
+						FTYPE r = re[k] * cl - im[k] * sl;
+						im[k] = re[k] * sl + im[k] * cl;
+						re[k] = r;
+					}
+
+				FTYPE zr = re[0], zi = im[0];
+				for (int i = nWhole; i < nSamples; i++)
+				{
+					pOutput[i] += a * zi;
+					FTYPE r = zr * c - zi * s;
+					zi = zr * s + zi * c;
+					zr = r;
+				}
+
+				// One Newton step towards |z| = 1, enough for the drift of one block
+				FTYPE g = 0.5 * (3.0 - (zr * zr + zi * zi));
+				dRe[p] = zr * g;
+				dIm[p] = zi * g;
+			}
+		}
+
+		// Adds nSamples of every partial to pOutput, for a bank owned by one voice
+		void render(FTYPE *pOutput, const int nSamples)
+		{
+			render(&pOutput, nSamples);
+		}
+	};
+
+	const int NOTE_OSCILLATORS = 4;
+	const int NOTE_LFOS = 1;
+	const int NOTE_PARTIALS = 8;
+	const int NOTE_MIN = -128;		// Lowest note ID with a tuning and voice table entry
+	const int NOTE_COUNT = 256;
+
+	// Stages of a running envelope
+	const int ENV_WAITING = 0;	// Note on is still ahead
+	const int ENV_ATTACK = 1;
+	const int ENV_DECAY = 2;
+	const int ENV_SUSTAIN = 3;
+	const int ENV_RELEASE = 4;
+	const int ENV_DONE = 5;
+
+	// Running state of one note's envelope. Each sample the level becomes
+	// dLevel * dMultiplier + dIncrement, which is a straight line for a multiplier
+	// of 1 and an exponential otherwise, and the stage changes after nRemaining
+	// samples. Rendering costs one multiply-add per sample and stage boundaries
+	// are known in advance.
+	struct envelope_state
+	{
+		int nStage;
+		FTYPE dLevel;
+		FTYPE dMultiplier;
+		FTYPE dIncrement;
+		int nRemaining;		// Samples left in this stage, -1 if it only ends on note off
+		FTYPE dTimeOn;		// Note times the state was last started and released for
+		FTYPE dTimeOff;
+
+		envelope_state()
+		{
+			nStage = ENV_DONE;
+			dLevel = 0.0;
+			dMultiplier = 1.0;
+			dIncrement = 0.0;
+			nRemaining = -1;
+			dTimeOn = -1.0;
+			dTimeOff = -1.0;
+		}
+	};
+
 	struct instrument_base;
 
 	// A basic note
@@ -43,63 +792,819 @@ namespace synth
 		//bool operator==(const note& n1, const note& n2) { return n1.id == n2.id; }
 	};
 
+
+
 	//////////////////////////////////////////////////////////////////////////////
-	// Multi-Function Oscillator
-	const int OSC_SINE = 0;
-	const int OSC_SQUARE = 1;
-	const int OSC_TRIANGLE = 2;
-	const int OSC_SAW_ANA = 3;
-	const int OSC_SAW_DIG = 4;
-	const int OSC_NOISE = 5;
+	// Render cache
+	//
+	// Apart from its noise and its envelope, a note of a patch depends only on
+	// the note ID, so the start of its tone can be rendered once and replayed
+	// under the voice's own envelope. Entries are keyed by a hash of the patch
+	// parameters and the note ID. They hold the raw partials of the attack and
+	// decay, or of the whole of a one-shot, together with the state to carry on
+	// rendering from. Once the cached entries outgrow the budget, the least
+	// recently used are dropped. Only the render service below touches the
+	// cache, so it takes no locks.
+
+	const size_t RENDER_CACHE_BUDGET = 64 << 20;	// Bytes
+
+	// FNV-1a over a block of bytes, continuing from nHash
+	uint64_t fnv1a(const void *pData, const size_t nBytes, uint64_t nHash = 0xCBF29CE484222325ull)
+	{
+		const unsigned char *p = (const unsigned char *)pData;
+		for (size_t i = 0; i < nBytes; i++)
+			nHash = (nHash ^ p[i]) * 0x100000001B3ull;
+		return nHash;
+	}
+
+	// The start of a note, the first sample at note on
+	struct note_render
+	{
+		int nId;					// Note ID it is the start of
+		vector<FTYPE> vecTone;		// Partials other than noise, before envelope and volume, in whole blocks
+		oscillator osc[NOTE_OSCILLATORS];	// State after the last sample
+		lfo mod[NOTE_LFOS];
+		sine_bank<NOTE_PARTIALS> bank;
+
+		size_t bytes() const
+		{
+			return sizeof(*this) + vecTone.size() * sizeof(FTYPE);
+		}
+	};
+
+	struct render_key
+	{
+		uint64_t nPatch;	// Hash of the patch parameters
+		int nId;
+
+		bool operator==(const render_key &k) const
+		{
+			return nPatch == k.nPatch && nId == k.nId;
+		}
+	};
+
+	struct render_key_hash
+	{
+		size_t operator()(const render_key &k) const
+		{
+			return (size_t)fnv1a(&k.nId, sizeof(k.nId), k.nPatch);
+		}
+	};
+
+	struct render_cache
+	{
+		size_t nBudget;		// Bytes the entries may take up
+		size_t nBytes;
+		uint64_t nHits;
+		uint64_t nMisses;
+		uint64_t nEvictions;
+
+		render_cache(const size_t budget = RENDER_CACHE_BUDGET)
+		{
+			nBudget = budget;
+			nBytes = 0;
+			nHits = 0;
+			nMisses = 0;
+			nEvictions = 0;
+		}
+
+		// The entry for k, or null
+		shared_ptr<const note_render> find(const render_key &k)
+		{
+			auto entry = mapEntries.find(k);
+			if (entry == mapEntries.end())
+				return nullptr;
+
+			listEntries.splice(listEntries.begin(), listEntries, entry->second);
+			return entry->second->second;
+		}
+
+		// Adds an entry for k, which must not be there yet
+		void insert(const render_key &k, const shared_ptr<const note_render> &render)
+		{
+			listEntries.emplace_front(k, render);
+			mapEntries[k] = listEntries.begin();
+			nBytes += render->bytes();
+		}
+
+		// Drops the least recently used entry if the entries are over budget,
+		// keeping at least one. Returns the dropped entry, or null. Voices still
+		// playing it keep it until they finish.
+		shared_ptr<const note_render> evict()
+		{
+			if (nBytes <= nBudget || listEntries.size() <= 1)
+				return nullptr;
+
+			shared_ptr<const note_render> render = listEntries.back().second;
+			nBytes -= render->bytes();
+			mapEntries.erase(listEntries.back().first);
+			listEntries.pop_back();
+			nEvictions++;
+			return render;
+		}
+
+		void clear()
+		{
+			listEntries.clear();
+			mapEntries.clear();
+			nBytes = 0;
+		}
+
+	private:
+		typedef list<pair<render_key, shared_ptr<const note_render>>> entry_list;
+		entry_list listEntries;		// Most recently used first
+		unordered_map<render_key, entry_list::iterator, render_key_hash> mapEntries;
+	};
+
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Note events
+	//
+	// The input loop never touches voices. It sends note events through a
+	// single-producer, single-consumer ring, and the audio thread applies them to
+	// the voice pool on the sample they are due, ending a block early where one
+	// falls inside it. Only the audio thread changes the voice pool; the render
+	// threads touch its voices only while the audio thread waits for them. Both
+	// ends of the ring only load and store their own index with acquire/release
+	// ordering, so neither ever waits on the other.
+
+	const int EVENT_NOTE_ON = 0;	// Starts a note, or restarts it if it is being released
+	const int EVENT_NOTE_OFF = 1;	// Releases a note
+	const int EVENT_RETRIGGER = 2;	// Restarts a note even if it is still held
+
+	struct note_event
+	{
+		int nType;
+		instrument_base *channel;
+		int id;
+		int64_t nSample;	// Output sample it happens on
+	};
+
+	// Lock-free ring for one producer and one consumer. CAPACITY is a power of 2.
+	template<class T, int CAPACITY>
+	struct spsc_queue
+	{
+		static_assert((CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of 2");
+
+		spsc_queue() : nRead(0), nWrite(0)
+		{
+		}
+
+		// Producer only. Returns false, dropping item, if the ring is full.
+		bool push(const T &item)
+		{
+			unsigned nAt = nWrite.load(memory_order_relaxed);
+			if (nAt - nRead.load(memory_order_acquire) == CAPACITY)
+				return false;
+
+			items[nAt & (CAPACITY - 1)] = item;
+			nWrite.store(nAt + 1, memory_order_release);
+			return true;
+		}
+
+		// Consumer only. Returns false if the ring is empty. Moves the item out,
+		// so the producer never releases what it overwrites.
+		bool pop(T &item)
+		{
+			unsigned nAt = nRead.load(memory_order_relaxed);
+			if (nAt == nWrite.load(memory_order_acquire))
+				return false;
+
+			item = move(items[nAt & (CAPACITY - 1)]);
+			nRead.store(nAt + 1, memory_order_release);
+			return true;
+		}
+
+	private:
+		T items[CAPACITY];
+		atomic<unsigned> nRead;		// Counts items popped
+		atomic<unsigned> nWrite;	// Counts items pushed
+	};
+
+	const int EVENT_CAPACITY = 1024;
+	typedef spsc_queue<note_event, EVENT_CAPACITY> event_queue;
+
+	// Renders voices are done with, from the audio thread to the render service.
+	// A voice may hold the last reference to an evicted render, and freeing it
+	// is left to the service so the audio thread never frees memory.
+	const int RETIRED_CAPACITY = 1024;
+	spsc_queue<shared_ptr<const note_render>, RETIRED_CAPACITY> retired;
+
+	// Drops the audio thread's reference to render, handing it to the render
+	// service. Only if the ring is full, which takes the service stalling for
+	// several blocks, may it be freed here.
+	void retire(shared_ptr<const note_render> &render)
+	{
+		if (render)
+			retired.push(render);
+		render.reset();
+	}
+
+
+	// A sounding note as an instrument renders it. Everything refers into the
+	// voice pool, which owns the state between blocks.
+	struct voice
+	{
+		int id;		// Position in scale
+		FTYPE on;	// Time note was activated
+		FTYPE off;	// Time note was deactivated
+		oscillator *osc;					// NOTE_OSCILLATORS oscillators
+		lfo *mod;							// NOTE_LFOS modulators shared by the oscillators
+		sine_bank<NOTE_PARTIALS> &bank;		// Fixed-frequency sine partials
+		envelope_state &adsr;				// Running state of the instrument's envelope
+		shared_ptr<const note_render> &render;	// Cached render being played, if any
+		FTYPE *tone;						// BLOCK_SIZE samples of raw tone rendered ahead
+		int &played;						// Samples of tone used since the note started
+	};
+
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Voice pool
+	//
+	// Holds up to MAX_VOICES sounding notes as a structure of arrays, one array
+	// per field, indexed by voice slot. All of it is allocated up front: slots
+	// are claimed from and returned to a free list, and a voice never moves
+	// while it sounds. nOrder lists the sounding voices sorted by instrument, so
+	// each instrument's voices form one run for the renderer. Oscillator phase
+	// and frequency stay inside the oscillator objects, which vectorise along the
+	// block rather than across voices.
+	//
+	// Past the polyphony limit a new note steals a voice chosen by the stealing
+	// policy. The stolen voice fades out over STEAL_FADE_SAMPLES in a slot above
+	// the limit, so at most MAX_VOICES voices ever render in one block. Under
+	// STEAL_SAME_NOTE a note played again while it sounds fades out the same way
+	// and starts over in a new voice.
+
+	const int MAX_VOICES = 256;
+	const int MAX_INSTRUMENTS = 16;
+	const int DEFAULT_POLYPHONY = 192;			// Leaves room for stolen voices to fade out
+	const int STEAL_FADE_SAMPLES = 220;			// 5 ms
+
+	// Voice stealing policies
+	const int STEAL_NONE = 0;		// Drop the new note
+	const int STEAL_OLDEST = 1;		// Earliest note on
+	const int STEAL_QUIETEST = 2;	// Lowest envelope level times volume
+	const int STEAL_SAME_NOTE = 3;	// Oldest, and a note played again restarts in a new voice
+	const int STEAL_PRIORITY = 4;	// Lowest instrument priority, oldest first, if not above the new note's
+
+	struct voice_pool
+	{
+		int nVoices;					// Sounding voices, including those fading out
+		int nMaxVoices;					// Polyphony limit, at most MAX_VOICES
+		int nStealPolicy;				// STEAL_ policy at the limit
+		int nPeak;						// Most voices sounding at once
+		uint64_t nStarted;				// Voices started
+		uint64_t nStolen;				// Voices faded out for new notes
+		uint64_t nRejected;				// Notes dropped at the polyphony limit
+		int nOrder[MAX_VOICES];			// Slots of the sounding voices, by instrument
+		instrument_base *pInstruments[MAX_INSTRUMENTS];	// In order of first use
+		int nInstruments;
+
+		int nInstrument[MAX_VOICES];	// Index into pInstruments
+		int nId[MAX_VOICES];
+		FTYPE dOn[MAX_VOICES];
+		FTYPE dOff[MAX_VOICES];
+		envelope_state adsr[MAX_VOICES];
+		oscillator osc[MAX_VOICES][NOTE_OSCILLATORS];
+		lfo mod[MAX_VOICES][NOTE_LFOS];
+		sine_bank<NOTE_PARTIALS> bank[MAX_VOICES];
+		shared_ptr<const note_render> render[MAX_VOICES];
+		FTYPE dTone[MAX_VOICES][BLOCK_SIZE];
+		int nPlayed[MAX_VOICES];
+		int nFade[MAX_VOICES];			// Samples left fading out after being stolen, 0 if not
+		int nVoiceOf[MAX_INSTRUMENTS][NOTE_COUNT];	// Voice by instrument and note ID - NOTE_MIN, or -1
+
+		voice_pool(const int maxVoices = DEFAULT_POLYPHONY, const int stealPolicy = STEAL_OLDEST)
+		{
+			nVoices = 0;
+			nMaxVoices = min(maxVoices, MAX_VOICES);
+			nStealPolicy = stealPolicy;
+			nPeak = 0;
+			nStarted = 0;
+			nStolen = 0;
+			nRejected = 0;
+			nInstruments = 0;
+
+			nFree = MAX_VOICES;
+			for (int v = 0; v < MAX_VOICES; v++)
+				nFreeSlots[v] = MAX_VOICES - 1 - v;
+
+			for (int i = 0; i < MAX_INSTRUMENTS; i++)
+				fill(nVoiceOf[i], nVoiceOf[i] + NOTE_COUNT, -1);
+		}
+
+		// Index of inst, registering it on first use, or -1 if there is no room
+		int instrument(instrument_base *inst)
+		{
+			for (int i = 0; i < nInstruments; i++)
+				if (pInstruments[i] == inst)
+					return i;
+
+			if (nInstruments == MAX_INSTRUMENTS)
+				return -1;
+			pInstruments[nInstruments] = inst;
+			return nInstruments++;
+		}
+
+		// Voice playing note id on inst, or -1. A table lookup for note IDs in the
+		// tuning range, however many voices are sounding.
+		int find(const instrument_base *inst, const int id) const
+		{
+			int i = 0;
+			while (i < nInstruments && pInstruments[i] != inst)
+				i++;
+			if (i == nInstruments)
+				return -1;
+
+			if (id >= NOTE_MIN && id < NOTE_MIN + NOTE_COUNT)
+				return nVoiceOf[i][id - NOTE_MIN];
+
+			for (int j = 0; j < nVoices; j++)
+			{
+				int v = nOrder[j];
+				if (nId[v] == id && nInstrument[v] == i && nFade[v] == 0)
+					return v;
+			}
+			return -1;
+		}
+
+		// Points the lookup table for voice v at nTo, if v is what it holds now or nTo is a voice
+		void map(const int v, const int nTo)
+		{
+			if (nId[v] < NOTE_MIN || nId[v] >= NOTE_MIN + NOTE_COUNT)
+				return;
+
+			int &nEntry = nVoiceOf[nInstrument[v]][nId[v] - NOTE_MIN];
+			if (nTo >= 0 || nEntry == v)
+				nEntry = nTo;
+		}
+
+		// Voices not fading out
+		int sounding() const
+		{
+			int n = 0;
+			for (int j = 0; j < nVoices; j++)
+				n += nFade[nOrder[j]] == 0;
+			return n;
+		}
+
+		// The voice to make way for a note on instrument i at dTime, or -1
+		int steal(const int i, const FTYPE dTime);
+
+		// Starts note id on inst at dTimeOn in a free slot, stealing a voice at the
+		// polyphony limit. Returns the voice, or -1 if the note was dropped.
+		int add(instrument_base *inst, const int id, const FTYPE dTimeOn)
+		{
+			int i = instrument(inst);
+			if (i < 0)
+			{
+				nRejected++;
+				return -1;
+			}
+
+			if (sounding() >= nMaxVoices)
+			{
+				int nVictim = steal(i, dTimeOn);
+				if (nVictim < 0)
+				{
+					nRejected++;
+					return -1;
+				}
+				nFade[nVictim] = STEAL_FADE_SAMPLES;
+				map(nVictim, -1);
+				nStolen++;
+			}
+
+			// No slot left to fade out in: cut the voice closest to silence
+			if (nFree == 0)
+			{
+				int nCut = -1;
+				for (int j = 0; j < nVoices; j++)
+					if (nFade[nOrder[j]] > 0 && (nCut < 0 || nFade[nOrder[j]] < nFade[nCut]))
+						nCut = nOrder[j];
+				if (nCut < 0)
+				{
+					nRejected++;
+					return -1;
+				}
+
+				bool bFinished[MAX_VOICES] = {};
+				bFinished[nCut] = true;
+				remove(bFinished);
+			}
+
+			int v = nFreeSlots[--nFree];
+			int j = nVoices++;
+			for (; j > 0 && nInstrument[nOrder[j - 1]] > i; j--)
+				nOrder[j] = nOrder[j - 1];
+			nOrder[j] = v;
+
+			nInstrument[v] = i;
+			nId[v] = id;
+			dOn[v] = dTimeOn;
+			dOff[v] = 0.0;
+			adsr[v] = envelope_state();
+			for (int k = 0; k < NOTE_OSCILLATORS; k++)
+				osc[v][k].noise = next_noise();
+			reset(v);
+			retire(render[v]);
+			nFade[v] = 0;
+			map(v, v);
+
+			nStarted++;
+			nPeak = max(nPeak, nVoices);
+			return v;
+		}
+
+		// Puts the sound of voice v back to the start of a note, keeping its noise
+		// generators. A restarted note so sounds as a new one would.
+		void reset(const int v)
+		{
+			for (int k = 0; k < NOTE_OSCILLATORS; k++)
+			{
+				noise_generator noise = osc[v][k].noise;
+				osc[v][k] = oscillator();
+				osc[v][k].noise = noise;
+			}
+			for (int k = 0; k < NOTE_LFOS; k++)
+				mod[v][k] = lfo();
+			bank[v] = sine_bank<NOTE_PARTIALS>();
+			nPlayed[v] = 0;
+		}
+
+		// Fades out voice v and starts its note over at dTime in a new voice.
+		// Returns the new voice, or -1 if the note was dropped.
+		int restart(const int v, const FTYPE dTime)
+		{
+			nFade[v] = STEAL_FADE_SAMPLES;
+			map(v, -1);
+			nStolen++;
+			return add(pInstruments[nInstrument[v]], nId[v], dTime);
+		}
+
+		// Fades out stolen voice v over the block it rendered into pSound, adding
+		// the result to pOutput. Returns true once it is silent.
+		bool fade(const int v, const FTYPE *pSound, FTYPE *pOutput, const int nSamples)
+		{
+			int n = min(nSamples, nFade[v]);
+			for (int i = 0; i < n; i++)
+				pOutput[i] += pSound[i] * (FTYPE)(nFade[v] - i) / STEAL_FADE_SAMPLES;
+
+			nFade[v] -= n;
+			return nFade[v] == 0;
+		}
+
+		// Returns the voices flagged in bFinished, by slot, to the free list
+		void remove(const bool *bFinished)
+		{
+			int n = 0;
+			for (int j = 0; j < nVoices; j++)
+			{
+				int v = nOrder[j];
+				if (bFinished[v])
+				{
+					map(v, -1);
+					retire(render[v]);
+					nFreeSlots[nFree++] = v;
+				}
+				else
+					nOrder[n++] = v;
+			}
+			nVoices = n;
+		}
+
+		// Applies a note event, on the audio thread. Returns the voice it started
+		// or restarted, or -1.
+		int apply(const note_event &e)
+		{
+			const FTYPE dTime = e.nSample / SAMPLE_RATE;
+			int v = find(e.channel, e.id);
+			switch (e.nType)
+			{
+			case EVENT_NOTE_ON:
+				if (v < 0)
+					return add(e.channel, e.id, dTime);
+				if (nStealPolicy == STEAL_SAME_NOTE)
+					return restart(v, dTime);
+				if (dOff[v] > dOn[v]) // Key has been pressed again during release phase
+				{
+					dOn[v] = dTime;
+					reset(v);
+					return v;
+				}
+				break;
+			case EVENT_NOTE_OFF:
+				if (v >= 0 && dOff[v] < dOn[v])
+					dOff[v] = dTime;
+				break;
+			case EVENT_RETRIGGER:
+				if (v < 0)
+					return add(e.channel, e.id, dTime);
+				if (nStealPolicy == STEAL_SAME_NOTE)
+					return restart(v, dTime);
+				dOn[v] = dTime;
+				reset(v);
+				return v;
+			}
+			return -1;
+		}
+
+		voice operator[](const int v)
+		{
+			return { nId[v], dOn[v], dOff[v], osc[v], mod[v], bank[v], adsr[v], render[v], dTone[v], nPlayed[v] };
+		}
+
+	private:
+		int nFreeSlots[MAX_VOICES];		// Free list, the next slot to claim last
+		int nFree;
+	};
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Render threads
+	//
+	// The sounding voices are split into partitions of nGranularity consecutive
+	// voices in the pool's order. Each partition renders into its own mix buffer
+	// on whichever thread claims it, and the buffers are summed in partition
+	// order. The mix so depends on the granularity but never on the number of
+	// threads or on which thread rendered what, and with all voices in one
+	// partition it is the same as rendering them one after another.
+	//
+	// The audio thread hands out a block without taking a lock. It posts a
+	// semaphore once for every worker it needs, partitions are claimed from an
+	// atomic counter, and it spins on a count of the workers still busy rather
+	// than sleeping until they are done.
+
+	const int DEFAULT_PARTITION_VOICES = 16;
+
+	struct render_pool
+	{
+		int nGranularity;		// Voices per partition
+
+		render_pool(const int threads = max(1, (int)thread::hardware_concurrency()),
+			const int granularity = DEFAULT_PARTITION_VOICES)
+		{
+			nGranularity = max(1, granularity);
+			vecMix.resize(MAX_VOICES * BLOCK_SIZE);
+			pStart = SDL_CreateSemaphore(0);
+			start(threads);
+		}
+
+		~render_pool()
+		{
+			stop();
+			SDL_DestroySemaphore(pStart);
+		}
+
+		render_pool(const render_pool &) = delete;
+		render_pool &operator=(const render_pool &) = delete;
+
+		// Restarts with nThreads threads in all, counting the one calling run().
+		// Not while run() is in progress.
+		void start(const int nThreads)
+		{
+			stop();
+			bStop = false;
+			for (int t = 1; t < nThreads; t++)
+				vecWorkers.emplace_back([this]() { work(); });
+		}
+
+		int threads() const
+		{
+			return (int)vecWorkers.size() + 1;
+		}
+
+		// Mix buffer of partition p, BLOCK_SIZE samples
+		FTYPE *mix(const int p)
+		{
+			return &vecMix[p * BLOCK_SIZE];
+		}
+
+		// Calls job(p) for every partition p in [0, nPartitions) on the render
+		// threads and the calling one, and returns once all of them are done.
+		// job is called through a plain function pointer, so nothing is allocated.
+		template<class F>
+		void run(const int nPartitions, F &&job)
+		{
+			if (nPartitions <= 1 || vecWorkers.empty())
+			{
+				for (int p = 0; p < nPartitions; p++)
+					job(p);
+				return;
+			}
+
+			pJob = &job;
+			pCall = [](void *pJob, const int p) { (*(remove_reference_t<F> *)pJob)(p); };
+			nJobs = nPartitions;
+			nNext.store(0, memory_order_relaxed);
+
+			int nWake = min((int)vecWorkers.size(), nPartitions - 1);
+			nAwake.store(nWake, memory_order_relaxed);
+			for (int t = 0; t < nWake; t++)
+				SDL_SemPost(pStart);
+
+			claim();
+			while (nAwake.load(memory_order_acquire) > 0)
+			{
+#if SYNTH_SIMD
+				_mm_pause();
+#endif
+			}
+		}
+
+	private:
+		// Runs unclaimed partitions until there are none left
+		void claim()
+		{
+			for (int p = nNext.fetch_add(1, memory_order_relaxed); p < nJobs; p = nNext.fetch_add(1, memory_order_relaxed))
+				pCall(pJob, p);
+		}
+
+		// Every wake-up is a post from run(), which waits for it to be answered,
+		// so a worker never sees the job of a run that has ended
+		void work()
+		{
+			for (;;)
+			{
+				SDL_SemWait(pStart);
+				if (bStop)
+					return;
+				claim();
+				nAwake.fetch_sub(1, memory_order_release);
+			}
+		}
+
+		void stop()
+		{
+			bStop = true;
+			for (size_t t = 0; t < vecWorkers.size(); t++)
+				SDL_SemPost(pStart);
+			for (auto &t : vecWorkers)
+				t.join();
+			vecWorkers.clear();
+		}
+
+		vector<FTYPE> vecMix;		// MAX_VOICES partitions of BLOCK_SIZE, enough for a granularity of 1
+		vector<thread> vecWorkers;
+		SDL_sem *pStart;			// Posted once for every worker a run wakes
+		void *pJob = nullptr;		// The job of the run in progress, called through pCall
+		void (*pCall)(void *, int) = nullptr;
+		int nJobs = 0;
+		atomic<int> nNext { 0 };	// Next partition to claim
+		atomic<int> nAwake { 0 };	// Workers woken by the run in progress that are not done yet
+		atomic<bool> bStop { false };
+	};
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Scale to Frequency conversion
+	//
+	// A tuning maps every note ID in [NOTE_MIN, NOTE_MIN + NOTE_COUNT) to a
+	// frequency up front, so scale() is a table lookup wherever it is called.
+
+	// 2^(k/12) for k = 0..11
+	constexpr FTYPE SEMITONES[12] = {
+		1.0, 1.0594630943592953, 1.122462048309373, 1.189207115002721,
+		1.2599210498948732, 1.3348398541700344, 1.4142135623730951, 1.4983070768766815,
+		1.5874010519681994, 1.681792830507429, 1.7817974362806785, 1.8877486253633868
+	};
+
+	// 5-limit just intonation ratios for the 12 degrees above the tonic
+	constexpr FTYPE JUST_RATIOS[12] = {
+		1.0, 16.0 / 15.0, 9.0 / 8.0, 6.0 / 5.0, 5.0 / 4.0, 4.0 / 3.0,
+		45.0 / 32.0, 3.0 / 2.0, 8.0 / 5.0, 5.0 / 3.0, 9.0 / 5.0, 15.0 / 8.0
+	};
+
+	struct tuning
+	{
+		FTYPE dHertz[NOTE_COUNT];
+
+		// Frequency of a note, clamped to the table
+		FTYPE hertz(const int nNoteID) const
+		{
+			return dHertz[min(max(nNoteID - NOTE_MIN, 0), NOTE_COUNT - 1)];
+		}
+	};
+
+	// Maps a note to its degree within a period of nDegrees and the number of periods from nReference
+	constexpr void degree(const int nNoteID, const int nReference, const int nDegrees, int &nDegree, int &nPeriods)
+	{
+		nPeriods = (nNoteID - nReference) / nDegrees;
+		nDegree = (nNoteID - nReference) % nDegrees;
+		if (nDegree < 0)
+		{
+			nDegree += nDegrees;
+			nPeriods--;
+		}
+	}
 
-	FTYPE osc(const FTYPE dTime, const FTYPE dHertz, const int nType = OSC_SINE,
-		const FTYPE dLFOHertz = 0.0, const FTYPE dLFOAmplitude = 0.0, FTYPE dCustom = 50.0)
+	// Scales dHertz by dPeriod^nPeriods
+	constexpr FTYPE periods(FTYPE dHertz, const FTYPE dPeriod, int nPeriods)
 	{
+		for (; nPeriods > 0; nPeriods--) dHertz *= dPeriod;
+		for (; nPeriods < 0; nPeriods++) dHertz /= dPeriod;
+		return dHertz;
+	}
 
-		FTYPE dFreq = w(dHertz) * dTime + dLFOAmplitude * dHertz * (sin(w(dLFOHertz) * dTime));
-
-		switch (nType)
+	// 12-tone equal temperament with nReferenceNote at dReferenceHertz
+	constexpr tuning equal_temperament(const FTYPE dReferenceHertz, const int nReferenceNote)
+	{
+		tuning t = {};
+		for (int i = 0; i < NOTE_COUNT; i++)
 		{
-		case OSC_SINE: // Sine wave bewteen -1 and +1
-			return sin(dFreq);
+			int nDegree = 0, nPeriods = 0;
+			degree(NOTE_MIN + i, nReferenceNote, 12, nDegree, nPeriods);
+			t.dHertz[i] = periods(dReferenceHertz * SEMITONES[nDegree], 2.0, nPeriods);
+		}
+		return t;
+	}
 
-		case OSC_SQUARE: // Square wave between -1 and +1
-			return sin(dFreq) > 0 ? 1.0 : -1.0;
+	// 5-limit just intonation built on nTonic at dTonicHertz
+	constexpr tuning just_intonation(const FTYPE dTonicHertz, const int nTonic)
+	{
+		tuning t = {};
+		for (int i = 0; i < NOTE_COUNT; i++)
+		{
+			int nDegree = 0, nPeriods = 0;
+			degree(NOTE_MIN + i, nTonic, 12, nDegree, nPeriods);
+			t.dHertz[i] = periods(dTonicHertz * JUST_RATIOS[nDegree], 2.0, nPeriods);
+		}
+		return t;
+	}
 
-		case OSC_TRIANGLE: // Triangle wave between -1 and +1
-			return asin(sin(dFreq)) * (2.0 / M_PI);
+	// Loads a Scala (.scl) scale file, with degree 0 on nReferenceNote at
+	// dReferenceHertz. Pitches are cents if they contain a '.', otherwise ratios
+	// such as 3/2 or 2; the last one is the period. Returns false and leaves t
+	// untouched if the file cannot be read or parsed.
+	bool load_scala(const string &sFileName, tuning &t, const FTYPE dReferenceHertz, const int nReferenceNote)
+	{
+		ifstream file(sFileName);
+		vector<FTYPE> vecRatios = { 1.0 };
+		int nLine = 0, nPitches = -1;
+		string sLine;
 
-		case OSC_SAW_ANA: // Saw wave (analogue / warm / slow)
+		while (getline(file, sLine))
 		{
-			FTYPE dOutput = 0.0;
-			for (FTYPE n = 1.0; n < dCustom; n++)
-				dOutput += (sin(n*dFreq)) / n;
-			return dOutput * (2.0 / M_PI);
-		}
+			size_t nStart = sLine.find_first_not_of(" \t\r");
+			if (nStart != string::npos && sLine[nStart] == '!')
+				continue;
 
-		case OSC_SAW_DIG:
-			return (2.0 / M_PI) * (dHertz * M_PI * fmod(dTime, 1.0 / dHertz) - (M_PI / 2.0));
+			if (nLine++ == 0) // Description
+				continue;
 
-		case OSC_NOISE:
-			return 2.0 * ((FTYPE)rand() / (FTYPE)RAND_MAX) - 1.0;
+			string sValue = nStart == string::npos ? "" : sLine.substr(nStart);
+			sValue = sValue.substr(0, sValue.find_first_of(" \t\r"));
 
-		default:
-			return 0.0;
+			if (nPitches < 0)
+				nPitches = atoi(sValue.c_str());
+			else if (sValue.find('.') != string::npos)
+				vecRatios.push_back(pow(2.0, atof(sValue.c_str()) / 1200.0));
+			else
+			{
+				size_t nSlash = sValue.find('/');
+				FTYPE dNum = atof(sValue.c_str());
+				FTYPE dDen = nSlash == string::npos ? 1.0 : atof(sValue.c_str() + nSlash + 1);
+				if (dNum <= 0.0 || dDen <= 0.0)
+					return false;
+				vecRatios.push_back(dNum / dDen);
+			}
+
+			if (nPitches >= 0 && (int)vecRatios.size() == nPitches + 1)
+				break;
 		}
+
+		if (nPitches <= 0 || (int)vecRatios.size() != nPitches + 1)
+			return false;
+
+		for (int i = 0; i < NOTE_COUNT; i++)
+		{
+			int nDegree = 0, nPeriods = 0;
+			degree(NOTE_MIN + i, nReferenceNote, nPitches, nDegree, nPeriods);
+			t.dHertz[i] = periods(dReferenceHertz * vecRatios[nDegree], vecRatios[nPitches], nPeriods);
+		}
+		return true;
 	}
 
-	//////////////////////////////////////////////////////////////////////////////
-	// Scale to Frequency conversion
+	const int SCALE_DEFAULT = 0;	// 12-TET with note 0 at 8 Hz, built at compile time
+	const int SCALE_JUST = 1;		// Just intonation on note 64, the first key
+	const int MAX_SCALES = 16;
+
+	constexpr tuning DEFAULT_TUNING = equal_temperament(8.0, 0);
+
+	// Tunings selectable by scale ID. Add new ones with add_scale() before audio starts.
+	tuning arrScales[MAX_SCALES] = { DEFAULT_TUNING, just_intonation(DEFAULT_TUNING.hertz(64), 64) };
+	int nScales = 2;
 
-	const int SCALE_DEFAULT = 0;
+	// Registers a tuning and returns its scale ID, or -1 if there is no room
+	int add_scale(const tuning &t)
+	{
+		if (nScales == MAX_SCALES)
+			return -1;
+		arrScales[nScales] = t;
+		return nScales++;
+	}
 
 	FTYPE scale(const int nNoteID, const int nScaleID = SCALE_DEFAULT)
 	{
-		switch (nScaleID)
-		{
-		case SCALE_DEFAULT: default:
-			return 8 * pow(1.0594630943592952645618252949463, nNoteID);
-		}		
+		return arrScales[nScaleID >= 0 && nScaleID < nScales ? nScaleID : SCALE_DEFAULT].hertz(nNoteID);
 	}
 
 
@@ -111,6 +1616,34 @@ namespace synth
 		virtual FTYPE amplitude(const FTYPE dTime, const FTYPE dTimeOn, const FTYPE dTimeOff) = 0;
 	};
 
+	// Shapes the fraction x of a segment. A curve of 0 is linear; otherwise the
+	// segment follows an exponential spanning dCurve time constants, which moves
+	// fast first and settles into its target for dCurve > 0, and the reverse for
+	// dCurve < 0.
+	FTYPE curve(const FTYPE x, const FTYPE dCurve)
+	{
+		if (dCurve == 0.0)
+			return x;
+		return (1.0 - exp(-dCurve * x)) / (1.0 - exp(-dCurve));
+	}
+
+	// Fraction of a segment from dFrom down to dTo, shaped by dCurve, at which
+	// the level reaches dLevel
+	FTYPE crossing(const FTYPE dFrom, const FTYPE dTo, const FTYPE dCurve, const FTYPE dLevel)
+	{
+		if (dFrom <= dLevel)
+			return 0.0;
+
+		FTYPE y = (dFrom - dLevel) / (dFrom - dTo);
+		if (dCurve == 0.0)
+			return y;
+		return -log(1.0 - y * (1.0 - exp(-dCurve))) / dCurve;
+	}
+
+	// Envelope level at or below which the gain is clamped to 0, so a note whose
+	// envelope stays there is silent and can be retired
+	const FTYPE ENV_SILENCE = 0.01;
+
 	struct envelope_adsr : public envelope
 	{
 		FTYPE dAttackTime;
@@ -118,6 +1651,9 @@ namespace synth
 		FTYPE dSustainAmplitude;
 		FTYPE dReleaseTime;
 		FTYPE dStartAmplitude;
+		FTYPE dAttackCurve;		// Segment shapes, see curve()
+		FTYPE dDecayCurve;
+		FTYPE dReleaseCurve;
 
 		envelope_adsr()
 		{
@@ -126,47 +1662,164 @@ namespace synth
 			dSustainAmplitude = 1.0;
 			dReleaseTime = 0.2;
 			dStartAmplitude = 1.0;
+			dAttackCurve = 0.0;
+			dDecayCurve = 0.0;
+			dReleaseCurve = 0.0;
+		}
+
+		// Level dLifeTime after note on, while the note is held
+		FTYPE level(const FTYPE dLifeTime) const
+		{
+			if (dLifeTime <= dAttackTime)
+				return curve(dLifeTime / dAttackTime, dAttackCurve) * dStartAmplitude;
+
+			if (dLifeTime <= (dAttackTime + dDecayTime))
+				return curve((dLifeTime - dAttackTime) / dDecayTime, dDecayCurve) * (dSustainAmplitude - dStartAmplitude) + dStartAmplitude;
+
+			return dSustainAmplitude;
 		}
 
 		virtual FTYPE amplitude(const FTYPE dTime, const FTYPE dTimeOn, const FTYPE dTimeOff)
 		{
 			FTYPE dAmplitude = 0.0;
-			FTYPE dReleaseAmplitude = 0.0;
 
 			if (dTimeOn > dTimeOff) // Note is on
+				dAmplitude = level(dTime - dTimeOn);
+			else // Note is off
 			{
-				FTYPE dLifeTime = dTime - dTimeOn;
+				FTYPE dReleaseAmplitude = level(dTimeOff - dTimeOn);
+				dAmplitude = curve((dTime - dTimeOff) / dReleaseTime, dReleaseCurve) * (0.0 - dReleaseAmplitude) + dReleaseAmplitude;
+			}
+
+			// Amplitude should not be negative
+			if (dAmplitude <= ENV_SILENCE)
+				dAmplitude = 0.0;
+
+			return dAmplitude;
+		}
+
+		// Time after which a note's amplitude stays at or below dSilence, or INFINITY
+		// while it may still sound. Only a decay to a silent sustain or a release
+		// can end a note, and both are solved for directly from the segment curves.
+		FTYPE end_time(const FTYPE dTimeOn, const FTYPE dTimeOff, const FTYPE dSilence) const
+		{
+			FTYPE dDecayEnd = INFINITY;
+			if (dSustainAmplitude <= dSilence)
+				dDecayEnd = dTimeOn + dAttackTime + dDecayTime * crossing(dStartAmplitude, dSustainAmplitude, dDecayCurve, dSilence);
 
-				if (dLifeTime <= dAttackTime)
-					dAmplitude = (dLifeTime / dAttackTime) * dStartAmplitude;
+			if (dTimeOff > dTimeOn && dTimeOff < dDecayEnd)
+				return dTimeOff + dReleaseTime * crossing(level(dTimeOff - dTimeOn), 0.0, dReleaseCurve, dSilence);
 
-				if (dLifeTime > dAttackTime && dLifeTime <= (dAttackTime + dDecayTime))
-					dAmplitude = ((dLifeTime - dAttackTime) / dDecayTime) * (dSustainAmplitude - dStartAmplitude) + dStartAmplitude;
+			return dDecayEnd;
+		}
 
-				if (dLifeTime > (dAttackTime + dDecayTime))
-					dAmplitude = dSustainAmplitude;
+		// Enters nStage with the level at dLevel
+		void enter(envelope_state &s, const int nStage, const FTYPE dLevel, const FTYPE dTimeStep)
+		{
+			s.nStage = nStage;
+			s.dLevel = dLevel;
+			s.dMultiplier = 1.0;
+			s.dIncrement = 0.0;
+			s.nRemaining = -1;
+
+			FTYPE dStageTime = 0.0, dTargetLevel = dLevel, dCurve = 0.0;
+			switch (nStage)
+			{
+			case ENV_ATTACK: dStageTime = dAttackTime; dTargetLevel = dStartAmplitude; dCurve = dAttackCurve; break;
+			case ENV_DECAY: dStageTime = dDecayTime; dTargetLevel = dSustainAmplitude; dCurve = dDecayCurve; break;
+			case ENV_RELEASE: dStageTime = dReleaseTime; dTargetLevel = 0.0; dCurve = dReleaseCurve; break;
+			default: return;
 			}
-			else // Note is off
+
+			int nSamples = (int)(dStageTime / dTimeStep + 0.5);
+			if (nSamples <= 0) // Zero-length stage
+			{
+				enter(s, nStage == ENV_RELEASE ? ENV_DONE : nStage + 1, dTargetLevel, dTimeStep);
+				return;
+			}
+			s.nRemaining = nSamples;
+
+			if (dCurve == 0.0)
+			{
+				s.dIncrement = (dTargetLevel - dLevel) / nSamples;
+				return;
+			}
+
+			// Exponential towards an asymptote placed so the segment ends on the
+			// target after nSamples: level = asymptote + (level - asymptote) * k
+			FTYPE dRatio = exp(-dCurve);
+			FTYPE dAsymptote = (dTargetLevel - dRatio * dLevel) / (1.0 - dRatio);
+			s.dMultiplier = exp(-dCurve / nSamples);
+			s.dIncrement = dAsymptote * (1.0 - s.dMultiplier);
+		}
+
+		// Writes nSamples of gain for a note, the first at dTime, advancing the
+		// note's envelope state. Gain follows amplitude(), but is computed by
+		// stepping the level rather than re-deriving it from the note's lifetime.
+		// Returns the index of the first sample after the envelope ended, either by
+		// finishing its release or by decaying to a silent sustain, or -1.
+		int render(envelope_state &s, const FTYPE dTime, const FTYPE dTimeStep,
+			const FTYPE dTimeOn, const FTYPE dTimeOff, FTYPE *pGain, const int nSamples)
+		{
+			if (dTimeOn != s.dTimeOn) // Note (re)started
+			{
+				s.dTimeOn = dTimeOn;
+				s.dTimeOff = -1.0;
+				s.nStage = ENV_WAITING;
+				s.dLevel = 0.0;
+				s.dMultiplier = 1.0;
+				s.dIncrement = 0.0;
+				s.nRemaining = max(0, (int)ceil((dTimeOn - dTime) / dTimeStep));
+			}
+
+			// Sample at which the note is released, if that is in this block
+			int nRelease = nSamples;
+			if (dTimeOff > dTimeOn && dTimeOff != s.dTimeOff)
+				nRelease = min(nSamples, max(0, (int)ceil((dTimeOff - dTime) / dTimeStep)));
+
+			int nEnded = -1;
+			for (int i = 0; i < nSamples;)
 			{
-				FTYPE dLifeTime = dTimeOff - dTimeOn;
+				if (i == nRelease && s.nStage != ENV_RELEASE && s.nStage != ENV_DONE)
+				{
+					s.dTimeOff = dTimeOff;
+					enter(s, s.nStage == ENV_WAITING ? ENV_DONE : ENV_RELEASE, s.dLevel, dTimeStep);
+				}
 
-				if (dLifeTime <= dAttackTime)
-					dReleaseAmplitude = (dLifeTime / dAttackTime) * dStartAmplitude;
+				if (nEnded < 0 && (s.nStage == ENV_DONE || (s.nStage == ENV_SUSTAIN && s.dLevel <= ENV_SILENCE)))
+					nEnded = i;
 
-				if (dLifeTime > dAttackTime && dLifeTime <= (dAttackTime + dDecayTime))
-					dReleaseAmplitude = ((dLifeTime - dAttackTime) / dDecayTime) * (dSustainAmplitude - dStartAmplitude) + dStartAmplitude;
+				// Run to the end of the stage, the release point or the end of the block
+				int nEnd = i < nRelease ? nRelease : nSamples;
+				if (s.nRemaining >= 0)
+					nEnd = min(nEnd, i + s.nRemaining);
 
-				if (dLifeTime > (dAttackTime + dDecayTime))
-					dReleaseAmplitude = dSustainAmplitude;
+				FTYPE dLevel = s.dLevel;
+				for (int j = i; j < nEnd; j++, dLevel = dLevel * s.dMultiplier + s.dIncrement)
+					pGain[j] = dLevel;
+				s.dLevel = dLevel;
 
-				dAmplitude = ((dTime - dTimeOff) / dReleaseTime) * (0.0 - dReleaseAmplitude) + dReleaseAmplitude;
+				if (s.nRemaining >= 0)
+				{
+					s.nRemaining -= nEnd - i;
+					if (s.nRemaining == 0)
+					{
+						if (s.nStage == ENV_WAITING)
+							enter(s, ENV_ATTACK, 0.0, dTimeStep);
+						else if (s.nStage == ENV_RELEASE)
+							enter(s, ENV_DONE, 0.0, dTimeStep);
+						else
+							enter(s, s.nStage + 1, s.nStage == ENV_ATTACK ? dStartAmplitude : dSustainAmplitude, dTimeStep);
+					}
+				}
+				i = nEnd;
 			}
 
 			// Amplitude should not be negative
-			if (dAmplitude <= 0.01)
-				dAmplitude = 0.0;
+			for (int i = 0; i < nSamples; i++)
+				pGain[i] = pGain[i] > ENV_SILENCE ? pGain[i] : 0.0;
 
-			return dAmplitude;
+			return nEnded;
 		}
 	};
 
@@ -176,183 +1829,718 @@ namespace synth
 	}
 
 
+	struct instrument_base;
+	struct instrument_patch;
+
+	// The closed set of instrument types. Resolving an instrument to one of these
+	// once per block lets its sound(), oscillators and envelope inline into a single
+	// loop over that instrument's voices. Anything else falls back to the virtual call.
+	typedef variant<instrument_base *, instrument_patch *> instrument_type;
+
 	struct instrument_base
 	{
 		FTYPE dVolume;
 		synth::envelope_adsr env;
 		FTYPE fMaxLifeTime;
 		wstring name;
-		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished) = 0;
+		int nScale;		// Tuning the instrument plays in
+		int nPriority;	// For STEAL_PRIORITY, lower is stolen first
+		instrument_type self;	// This instrument as its concrete type
+
+		instrument_base()
+		{
+			nScale = SCALE_DEFAULT;
+			nPriority = 0;
+			self = this;
+		}
+
+		virtual ~instrument_base() = default;
+
+		// Returns one sample of note n at dTime, setting bNoteFinished once it has ended
+		virtual FTYPE sound(const FTYPE dTime, synth::voice &n, bool &bNoteFinished) = 0;
+
+		// Adds nSamples (<= BLOCK_SIZE) samples of note n, the first at dTime, to pOutput.
+		// Returns the offset of the first sample after the note finished, or -1 if it
+		// sounds on past the block. Instruments written one sample at a time get this
+		// adapter, calling sound() for each sample.
+		virtual int sound_block(const FTYPE dTime, const FTYPE dTimeStep, synth::voice &n,
+			FTYPE *pOutput, const int nSamples)
+		{
+			for (int i = 0; i < nSamples; i++)
+			{
+				bool bNoteFinished = false;
+				pOutput[i] += sound(dTime + i * dTimeStep, n, bNoteFinished);
+				if (bNoteFinished)
+					return i + 1;
+			}
+			return -1;
+		}
+
+		// True if note n stays silent from dTime on, because its envelope has fallen
+		// to ENV_SILENCE for good. Such a note need not be rendered and can be retired.
+		bool finished(const synth::voice &n, const FTYPE dTime, const FTYPE dTimeStep) const
+		{
+			// One sample of margin for stage lengths rounded to whole samples
+			return dTime >= env.end_time(n.on, n.off, ENV_SILENCE) + dTimeStep;
+		}
+
+		// Scales a block of raw note output by the envelope and volume and adds it to
+		// pOutput. Stops after the sample on which the note finished, which is when
+		// the envelope ends or, if bLifeTimeLimited, after fMaxLifeTime, and returns
+		// the offset it stopped at as sound_block() does.
+		int mix(const FTYPE dTime, const FTYPE dTimeStep, synth::voice &n, const FTYPE *pSound,
+			FTYPE *pOutput, const int nSamples, const bool bLifeTimeLimited)
+		{
+			FTYPE dGain[BLOCK_SIZE];
+			int nEnded = env.render(n.adsr, dTime, dTimeStep, n.on, n.off, dGain, nSamples);
+			int nEnd = nSamples;
+			bool bFinished = false;
+
+			if (nEnded >= 0)
+			{
+				nEnd = min(nSamples, nEnded + 1);
+				bFinished = true;
+			}
+
+			if (bLifeTimeLimited && fMaxLifeTime > 0.0)
+			{
+				int nLast = max(0, (int)ceil((n.on + fMaxLifeTime - dTime) / dTimeStep));
+				if (nLast < nEnd)
+				{
+					nEnd = nLast + 1;
+					bFinished = true;
+				}
+			}
+
+			for (int i = 0; i < nEnd; i++)
+				pOutput[i] += dGain[i] * pSound[i] * dVolume;
+
+			return bFinished ? nEnd : -1;
+		}
 	};
 
-	struct instrument_bell : public instrument_base
+	// Registers the concrete type T in self, so voices of T dispatch without a virtual call
+	template<class T>
+	struct instrument : public instrument_base
 	{
-		instrument_bell()
+		instrument() = default;
+		instrument(const instrument &other) = default;
+
+		instrument &operator=(const instrument &other)
 		{
-			env.dAttackTime = 0.01;
-			env.dDecayTime = 1.0;
-			env.dSustainAmplitude = 0.0;
-			env.dReleaseTime = 1.0;
-			fMaxLifeTime = 3.0;
-			dVolume = 1.0;
-			name = L"Bell";
+			instrument_base::operator=(other);
+			bind();
+			return *this;
 		}
 
-		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished)
+	protected:
+		// For T's constructors to call: the cast is only valid once T is constructed
+		void bind()
+		{
+			self = static_cast<T *>(this);
+		}
+	};
+
+	int voice_pool::steal(const int i, const FTYPE dTime)
+	{
+		int nVictim = -1;
+		FTYPE dBest = 0.0;
+		for (int j = 0; j < nVoices; j++)
 		{
-			FTYPE dAmplitude = synth::env(dTime, env, n.on, n.off);
-			if (dAmplitude <= 0.0) bNoteFinished = true;
+			int v = nOrder[j];
+			if (nFade[v] > 0)
+				continue;
 
-			FTYPE dSound =
-				+ 1.00 * synth::osc(dTime - n.on, synth::scale(n.id + 12), synth::OSC_SINE, 5.0, 0.001)
-				+ 0.50 * synth::osc(dTime - n.on, synth::scale(n.id + 24))
-				+ 0.25 * synth::osc(dTime - n.on, synth::scale(n.id + 36));
+			instrument_base *inst = pInstruments[nInstrument[v]];
+			FTYPE dScore = dOn[v];	// Lowest is stolen
+			switch (nStealPolicy)
+			{
+			case STEAL_NONE:
+				return -1;
+			case STEAL_QUIETEST:
+				dScore = inst->env.amplitude(dTime, dOn[v], dOff[v]) * inst->dVolume;
+				break;
+			case STEAL_PRIORITY:
+				if (inst->nPriority > pInstruments[i]->nPriority)
+					continue;
+				dScore = inst->nPriority * 1e9 + dOn[v];	// Priority first, then the oldest
+				break;
+			}
 
-			return dAmplitude * dSound * dVolume;
+			if (nVictim < 0 || dScore < dBest)
+			{
+				nVictim = v;
+				dBest = dScore;
+			}
 		}
+		return nVictim;
+	}
 
+	//////////////////////////////////////////////////////////////////////////////
+	// Patches
+	//
+	// An instrument described by data. A patch is a text file of "key values"
+	// lines, with # starting a comment:
+	//
+	//   name Bell
+	//   volume 1.0          Output gain
+	//   lifetime 3.0        Seconds a note may last, <= 0 for no limit
+	//   limited 0           1 for a one-shot cut at its lifetime
+	//   scale 0             Scale ID the notes are tuned in
+	//   priority 0          Lower is stolen first at the polyphony limit
+	//   lfo 5.0             Hertz of the LFO shared by the partials
+	//   attack 0.01 [curve] Envelope segment times, with curve() shapes
+	//   decay 1.0 [curve]
+	//   sustain 0.0
+	//   release 1.0 [curve]
+	//   <waveform> <note offset> <amplitude> [lfo depth] [custom]
+	//
+	// where waveform is sine, square, triangle, saw_ana, saw_dig, noise or pulse
+	// for one of the voice's oscillators, or bank for a fixed sine partial from
+	// its sine bank. Values in [] may be left out, as may whole keys, which then
+	// keep the defaults of instrument_patch. Loading compiles the partials into
+	// a flat table, which instrument_patch::sound() renders for every patch.
+	//
+	// A voice renders the tone of its partials, all but noise, a block at a time
+	// from note on, whatever blocks the output is split into, and applies its
+	// envelope, noise and volume as the output asks for samples. Notes start out
+	// from the render cache when their entry is ready. A cached tone was rendered
+	// in the same blocks from the same state, so a note sounds the same to the
+	// last bit whether or not it was cached, and output never depends on how far
+	// the render service has got. A one-shot's tone is cached whole; other notes
+	// carry on rendering live after their attack and decay.
+
+	const int OSC_BANK = 7;		// Partial rendered by the voice's sine bank, patches only
+	const int MAX_PATCH_PARTIALS = NOTE_OSCILLATORS + NOTE_PARTIALS;
+
+	// One waveform of a patch, nOffset notes from the note played
+	struct partial
+	{
+		int nType;
+		int nOffset;
+		FTYPE dAmplitude;
+		FTYPE dDepth;		// Of the patch LFO, 0 for none
+		FTYPE dCustom;
+		const wavetable *pTable;	// For OSC_SAW_ANA, else null
 	};
 
-	struct instrument_bell8 : public instrument_base
+	struct instrument_patch final : public instrument<instrument_patch>
 	{
-		instrument_bell8()
+		FTYPE dLFOHertz;
+		bool bLifeTimeLimited;
+		partial arrPartials[MAX_PATCH_PARTIALS];	// Oscillators first, then bank partials
+		int nPartials;
+		int nOscillators;
+
+		instrument_patch()
 		{
-			env.dAttackTime = 0.01;
-			env.dDecayTime = 0.5;
-			env.dSustainAmplitude = 0.8;
-			env.dReleaseTime = 1.0;
-			fMaxLifeTime = 3.0;
+			bind();
 			dVolume = 1.0;
-			name = L"8-Bit Bell";
+			fMaxLifeTime = -1.0;
+			dLFOHertz = 0.0;
+			bLifeTimeLimited = false;
+			nPartials = 0;
+			nOscillators = 0;
 		}
 
-		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished)
+		// Copies must refer to themselves, not to the original
+		instrument_patch(const instrument_patch &other) : instrument_patch()
 		{
-			FTYPE dAmplitude = synth::env(dTime, env, n.on, n.off);
-			if (dAmplitude <= 0.0) bNoteFinished = true;
+			*this = other;
+		}
 
-			FTYPE dSound =
-				+1.00 * synth::osc(dTime - n.on, synth::scale(n.id), synth::OSC_SQUARE, 5.0, 0.001)
-				+ 0.50 * synth::osc(dTime - n.on, synth::scale(n.id + 12))
-				+ 0.25 * synth::osc(dTime - n.on, synth::scale(n.id + 24));
+		instrument_patch &operator=(const instrument_patch &other) = default;
 
-			return dAmplitude * dSound * dVolume;
+		// Adds a partial, keeping oscillators ahead of bank partials. Returns false
+		// if the voice has no oscillator or bank slot left for it.
+		bool add(const int nType, const int nOffset, const FTYPE dAmplitude,
+			const FTYPE dDepth = 0.0, const FTYPE dCustom = 50.0)
+		{
+			bool bBank = nType == OSC_BANK;
+			if (bBank ? nPartials - nOscillators == NOTE_PARTIALS : nOscillators == NOTE_OSCILLATORS)
+				return false;
+
+			int p = bBank ? nPartials : nOscillators++;
+			for (int k = nPartials++; k > p; k--)
+				arrPartials[k] = arrPartials[k - 1];
+
+			// Look the wavetable up now rather than while rendering
+			arrPartials[p] = { nType, nOffset, dAmplitude, dDepth, dCustom,
+				nType == OSC_SAW_ANA ? &saw_table(saw_partials(dCustom)) : nullptr };
+			return true;
 		}
 
-	};
+		virtual FTYPE sound(const FTYPE dTime, synth::voice &n, bool &bNoteFinished)
+		{
+			FTYPE dOutput = 0.0;
+			bNoteFinished = sound_block(dTime, 1.0 / SAMPLE_RATE, n, &dOutput, 1) >= 0;
+			return dOutput;
+		}
 
-	struct instrument_harmonica : public instrument_base
-	{
-		instrument_harmonica()
+		bool is_one_shot() const
 		{
-			env.dAttackTime = 0.00;
-			env.dDecayTime = 1.0;
-			env.dSustainAmplitude = 0.95;
-			env.dReleaseTime = 0.5;
-			fMaxLifeTime = -1.0;
-			name = L"Harmonica";
-			dVolume = 0.3;
+			return bLifeTimeLimited && fMaxLifeTime > 0.0;
 		}
 
-		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished)
+		virtual int sound_block(const FTYPE dTime, const FTYPE dTimeStep, synth::voice &n,
+			FTYPE *pOutput, const int nSamples)
 		{
-			FTYPE dAmplitude = synth::env(dTime, env, n.on, n.off);
-			if (dAmplitude <= 0.0) bNoteFinished = true;
+			FTYPE dSound[BLOCK_SIZE];
+			for (int i = 0; i < nSamples;)
+			{
+				int nAt = n.played % BLOCK_SIZE;
+				if (nAt == 0)
+					tone(n);
+
+				int nCopy = min(nSamples - i, BLOCK_SIZE - nAt);
+				copy(n.tone + nAt, n.tone + nAt + nCopy, dSound + i);
+				n.played += nCopy;
+				i += nCopy;
+			}
 
-			FTYPE dSound =
-				+ 1.0  * synth::osc(n.on - dTime, synth::scale(n.id-12), synth::OSC_SAW_ANA, 5.0, 0.001, 100)
-				+ 1.00 * synth::osc(dTime - n.on, synth::scale(n.id), synth::OSC_SQUARE, 5.0, 0.001)
-				+ 0.50 * synth::osc(dTime - n.on, synth::scale(n.id + 12), synth::OSC_SQUARE)
-				+ 0.05  * synth::osc(dTime - n.on, synth::scale(n.id + 24), synth::OSC_NOISE);
+			noise(n, dSound, nSamples);
+			return mix(dTime, dTimeStep, n, dSound, pOutput, nSamples, bLifeTimeLimited);
+		}
+
+		// Renders the next BLOCK_SIZE samples of the tone of note n into n.tone,
+		// from the cached start of the note while that lasts and live from the
+		// state it ended in after. Both render the partials in the same steps
+		// from the same state, so they come out the same to the last bit.
+		void tone(synth::voice &n)
+		{
+			if (n.render && n.played < (int)n.render->vecTone.size())
+			{
+				const FTYPE *pCached = &n.render->vecTone[n.played];
+				copy(pCached, pCached + BLOCK_SIZE, n.tone);
+				if (n.played + BLOCK_SIZE == (int)n.render->vecTone.size())
+					resume(n);
+				return;
+			}
 
-			return dAmplitude * dSound * dVolume;
+			fill(n.tone, n.tone + BLOCK_SIZE, 0.0);
+			partials(n, n.tone, BLOCK_SIZE);
 		}
 
-	};
+		// Adds the next nSamples of every partial of note n but noise to pSound
+		void partials(synth::voice &n, FTYPE *pSound, const int nSamples)
+		{
+			const FTYPE *pLFO = n.mod[0].render(dLFOHertz, nSamples);
 
+			for (int p = 0; p < nOscillators; p++)
+			{
+				const partial &w = arrPartials[p];
+				if (w.nType == OSC_NOISE)
+					continue;
+				n.osc[p].set(synth::scale(n.id + w.nOffset, nScale), w.nType, 0.0, 0.0, w.dCustom);
+				n.osc[p].pTable = w.pTable;
+				n.osc[p].render(pSound, nSamples, w.dAmplitude, w.dDepth != 0.0 ? pLFO : nullptr, w.dDepth);
+			}
 
-	struct instrument_drumkick : public instrument_base
-	{
-		instrument_drumkick()
+			if (nPartials > nOscillators)
+			{
+				for (int p = nOscillators; p < nPartials; p++)
+					n.bank.set(p - nOscillators, synth::scale(n.id + arrPartials[p].nOffset, nScale), arrPartials[p].dAmplitude);
+				n.bank.render(pSound, nSamples);
+			}
+		}
+
+		// Adds the next nSamples of the noise partials of note n to pSound, from
+		// the voice's own generators whether or not its tone is cached
+		void noise(synth::voice &n, FTYPE *pSound, const int nSamples)
 		{
-			env.dAttackTime = 0.01;
-			env.dDecayTime = 0.15;
-			env.dSustainAmplitude = 0.0;
-			env.dReleaseTime = 0.0;
-			fMaxLifeTime = 1.5;
-			name = L"Drum Kick";
-			dVolume = 1.0;
+			for (int p = 0; p < nOscillators; p++)
+				if (arrPartials[p].nType == OSC_NOISE)
+					n.osc[p].render<OSC_NOISE>(pSound, nSamples, arrPartials[p].dAmplitude);
+		}
+
+		// Hash of every parameter that shapes the sound of a note
+		uint64_t hash() const
+		{
+			const FTYPE dParams[] = {
+				dVolume, fMaxLifeTime, dLFOHertz, (FTYPE)bLifeTimeLimited, (FTYPE)nScale,
+				env.dAttackTime, env.dDecayTime, env.dSustainAmplitude, env.dReleaseTime,
+				env.dStartAmplitude, env.dAttackCurve, env.dDecayCurve, env.dReleaseCurve
+			};
+			return fnv1a(dParams, sizeof(dParams), fnv1a(arrPartials, nPartials * sizeof(partial)));
 		}
 
-		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished)
+		// Renders the cached start of note ID id: the partials other than noise,
+		// without envelope or volume, through the attack and decay, or until a
+		// one-shot ends or at the latest reaches its lifetime, in whole blocks as
+		// tone() renders them. Returns null if there is nothing to render.
+		shared_ptr<const note_render> render_start(const int id)
 		{
-			FTYPE dAmplitude = synth::env(dTime, env, n.on, n.off);
-			if(fMaxLifeTime > 0.0 && dTime - n.on >= fMaxLifeTime)	bNoteFinished = true;
+			const FTYPE dTimeStep = 1.0 / SAMPLE_RATE;
+			int nLength = is_one_shot()
+				? (int)ceil(min((FTYPE)fMaxLifeTime, env.end_time(0.0, -1.0, ENV_SILENCE) + dTimeStep) / dTimeStep) + 1
+				: (int)ceil((env.dAttackTime + env.dDecayTime) / dTimeStep);
+			if (nLength <= 0)
+				return nullptr;
+			nLength = (nLength + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+
+			auto r = make_shared<note_render>();
+			envelope_state adsr;
+			shared_ptr<const note_render> none;
+			int nPlayed = 0;
+			synth::voice n = { id, 0.0, -1.0, r->osc, r->mod, r->bank, adsr, none, nullptr, nPlayed };
+
+			r->nId = id;
+			r->vecTone.assign(nLength, 0.0);
+			for (int i = 0; i < nLength; i += BLOCK_SIZE)
+				partials(n, &r->vecTone[i], BLOCK_SIZE);
+			return r;
+		}
 
-			FTYPE dSound =
-				+ 0.99 * synth::osc(dTime - n.on, synth::scale(n.id - 36), synth::OSC_SINE, 1.0, 1.0)
-				+ 0.01 * synth::osc(dTime - n.on, 0, synth::OSC_NOISE);
-				
-			return dAmplitude * dSound * dVolume;
+		// Takes over the state at the end of the cached start of note n, keeping
+		// the voice's own noise
+		void resume(synth::voice &n)
+		{
+			const note_render &r = *n.render;
+			for (int p = 0; p < NOTE_OSCILLATORS; p++)
+			{
+				noise_generator noise = n.osc[p].noise;
+				n.osc[p] = r.osc[p];
+				n.osc[p].noise = noise;
+			}
+			for (int m = 0; m < NOTE_LFOS; m++)
+				n.mod[m] = r.mod[m];
+			n.bank = r.bank;
 		}
+	};
 
+	//////////////////////////////////////////////////////////////////////////////
+	// Render service
+	//
+	// Fills the render cache on a thread of its own, so the audio thread never
+	// renders or allocates a cache entry and never waits for one. Entries ready
+	// for a patch are published in a table by instrument and note ID, which the
+	// audio thread reads when a note starts: a note starts from its entry if it
+	// is there, and otherwise plays live while the service renders the entry for
+	// the next time. Either way the audio thread asks the service for the note
+	// through a lock-free ring, which also keeps the cache's use order up to date.
+	// The service frees the renders voices retire as well, so nothing on the
+	// audio thread allocates or frees memory.
+	//
+	// Publishing is lock-free as well. The audio thread flags that it is reading
+	// the table around every read; the service clears an entry's published flag,
+	// then waits for any read in progress to finish before it touches the entry.
+
+	const int RENDER_REQUESTS = 1024;
+	const int RENDER_POLL_MS = 1;	// How often the service looks for work while idle
+
+	struct render_request
+	{
+		instrument_patch *patch;
+		int nInstrument;	// Index of patch in the voice pool
+		int id;
+		bool bHit;			// Whether the note started from a published entry
 	};
 
-	struct instrument_drumsnare : public instrument_base
+	struct render_service
 	{
-		instrument_drumsnare()
+		render_cache cache;
+
+		render_service()
 		{
-			env.dAttackTime = 0.0;
-			env.dDecayTime = 0.2;
-			env.dSustainAmplitude = 0.0;
-			env.dReleaseTime = 0.0;
-			fMaxLifeTime = 1.0;
-			name = L"Drum Snare";
-			dVolume = 1.0;
+			for (int i = 0; i < MAX_INSTRUMENTS; i++)
+				for (int k = 0; k < NOTE_COUNT; k++)
+					bPublished[i][k] = false;
+			bReading = false;
+			bStop = false;
+			worker = thread([this]() { work(); });
+		}
+
+		~render_service()
+		{
+			stop();
 		}
 
-		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished)
+		render_service(const render_service &) = delete;
+		render_service &operator=(const render_service &) = delete;
+
+		// Starts voice v of pool from the published render of its note, if there
+		// is one, and asks for the render. On the audio thread, when an event
+		// starts or restarts the voice.
+		void attach(voice_pool &pool, const int v)
 		{
-			FTYPE dAmplitude = synth::env(dTime, env, n.on, n.off);
-			if (fMaxLifeTime > 0.0 && dTime - n.on >= fMaxLifeTime)	bNoteFinished = true;
+			retire(pool.render[v]);
+
+			const int i = pool.nInstrument[v];
+			instrument_patch *const *pPatch = get_if<instrument_patch *>(&pool.pInstruments[i]->self);
+			if (!pPatch || pool.nId[v] < NOTE_MIN || pool.nId[v] >= NOTE_MIN + NOTE_COUNT)
+				return;
 
-			FTYPE dSound =
-				+ 0.5 * synth::osc(dTime - n.on, synth::scale(n.id - 24), synth::OSC_SINE, 0.5, 1.0)
-				+ 0.5 * synth::osc(dTime - n.on, 0, synth::OSC_NOISE);
+			const int k = pool.nId[v] - NOTE_MIN;
+			bReading = true;
+			if (bPublished[i][k])
+				pool.render[v] = published[i][k];
+			bReading = false;
 
-			return dAmplitude * dSound * dVolume;
+			requests.push({ *pPatch, i, pool.nId[v], pool.render[v] != nullptr });
 		}
 
-	};
+		// Ends the service thread. Requests still queued are dropped.
+		void stop()
+		{
+			bStop = true;
+			if (worker.joinable())
+				worker.join();
+		}
+
+	private:
+		void work()
+		{
+			while (!bStop)
+			{
+				shared_ptr<const note_render> render;
+				while (retired.pop(render))
+					render.reset();
 
+				render_request r;
+				bool bIdle = true;
+				while (requests.pop(r))
+				{
+					serve(r);
+					bIdle = false;
+				}
 
-	struct instrument_drumhihat : public instrument_base
-	{
-		instrument_drumhihat()
+				if (bIdle)
+					this_thread::sleep_for(chrono::milliseconds(RENDER_POLL_MS));
+			}
+		}
+
+		// Looks up or renders the entry a note asked for, and publishes it if
+		// the note did not find it
+		void serve(const render_request &r)
 		{
-			env.dAttackTime = 0.01;
-			env.dDecayTime = 0.05;
-			env.dSustainAmplitude = 0.0;
-			env.dReleaseTime = 0.0;
-			fMaxLifeTime = 1.0;
-			name = L"Drum HiHat";
-			dVolume = 0.5;
+			render_key k = { r.patch->hash(), r.id };
+			shared_ptr<const note_render> entry = cache.find(k);
+			if (!entry)
+			{
+				entry = r.patch->render_start(r.id);
+				if (!entry)
+					return;
+				cache.insert(k, entry);
+			}
+
+			if (r.bHit)
+				cache.nHits++;
+			else
+			{
+				cache.nMisses++;
+				publish(r.nInstrument, r.id - NOTE_MIN, entry);
+			}
+
+			while (shared_ptr<const note_render> evicted = cache.evict())
+				for (int i = 0; i < MAX_INSTRUMENTS; i++)
+					if (published[i][evicted->nId - NOTE_MIN] == evicted)
+						unpublish(i, evicted->nId - NOTE_MIN);
 		}
 
-		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool &bNoteFinished)
+		void publish(const int i, const int k, const shared_ptr<const note_render> &entry)
 		{
-			FTYPE dAmplitude = synth::env(dTime, env, n.on, n.off);
-			if (fMaxLifeTime > 0.0 && dTime - n.on >= fMaxLifeTime)	bNoteFinished = true;
+			if (bPublished[i][k] && published[i][k] == entry)
+				return;
 
-			FTYPE dSound =
-				+ 0.1 * synth::osc(dTime - n.on, synth::scale(n.id -12), synth::OSC_SQUARE, 1.5, 1)
-				+ 0.9 * synth::osc(dTime - n.on, 0, synth::OSC_NOISE);
+			unpublish(i, k);
+			published[i][k] = entry;
+			bPublished[i][k] = true;
+		}
 
-			return dAmplitude * dSound * dVolume;
+		void unpublish(const int i, const int k)
+		{
+			bPublished[i][k] = false;
+			while (bReading)
+				this_thread::yield();
+			published[i][k].reset();
 		}
 
+		spsc_queue<render_request, RENDER_REQUESTS> requests;		// From the audio thread
+		shared_ptr<const note_render> published[MAX_INSTRUMENTS][NOTE_COUNT];
+		atomic<bool> bPublished[MAX_INSTRUMENTS][NOTE_COUNT];
+		atomic<bool> bReading;		// Set by the audio thread while it reads published
+		atomic<bool> bStop;
+		thread worker;
 	};
 
+	render_service renders;
+
+	// Reads a required value from a patch line. Returns false if it is missing or malformed.
+	template<class T>
+	bool required(istream &line, T &value)
+	{
+		return (bool)(line >> value);
+	}
+
+	// Reads an optional value from a patch line, leaving value as it is if the
+	// line has ended. Returns false if what is there is malformed.
+	template<class T>
+	bool optional(istream &line, T &value)
+	{
+		return (line >> ws).eof() || (line >> value);
+	}
+
+	// Reads a patch from text as described above, starting from the defaults of
+	// instrument_patch for any key the text leaves out. Returns false, leaving the
+	// patch partly set, on an unknown key or waveform, a missing, malformed or
+	// extra value, or too many partials.
+	bool parse_patch(istream &in, instrument_patch &patch)
+	{
+		static const map<string, int> mapWaveforms = {
+			{ "sine", OSC_SINE }, { "square", OSC_SQUARE }, { "triangle", OSC_TRIANGLE },
+			{ "saw_ana", OSC_SAW_ANA }, { "saw_dig", OSC_SAW_DIG }, { "noise", OSC_NOISE },
+			{ "pulse", OSC_PULSE }, { "bank", OSC_BANK }
+		};
+
+		patch = instrument_patch();
+
+		string sLine;
+		while (getline(in, sLine))
+		{
+			istringstream line(sLine.substr(0, sLine.find('#')));
+			string sKey;
+			if (!(line >> sKey))
+				continue;
+
+			envelope_adsr &env = patch.env;
+			auto wave = mapWaveforms.find(sKey);
+			bool bRead = true;
+			if (sKey == "name")
+			{
+				string sName;
+				getline(line >> ws, sName);
+				patch.name = wstring(sName.begin(), sName.end());
+			}
+			else if (sKey == "volume") bRead = required(line, patch.dVolume);
+			else if (sKey == "lifetime") bRead = required(line, patch.fMaxLifeTime);
+			else if (sKey == "limited") bRead = required(line, patch.bLifeTimeLimited);
+			else if (sKey == "scale") bRead = required(line, patch.nScale);
+			else if (sKey == "priority") bRead = required(line, patch.nPriority);
+			else if (sKey == "lfo") bRead = required(line, patch.dLFOHertz);
+			else if (sKey == "attack") bRead = required(line, env.dAttackTime) && optional(line, env.dAttackCurve);
+			else if (sKey == "decay") bRead = required(line, env.dDecayTime) && optional(line, env.dDecayCurve);
+			else if (sKey == "sustain") bRead = required(line, env.dSustainAmplitude);
+			else if (sKey == "release") bRead = required(line, env.dReleaseTime) && optional(line, env.dReleaseCurve);
+			else if (wave != mapWaveforms.end())
+			{
+				int nOffset = 0;
+				FTYPE dAmplitude = 1.0, dDepth = 0.0, dCustom = 50.0;
+				bRead = required(line, nOffset) && required(line, dAmplitude)
+					&& optional(line, dDepth) && optional(line, dCustom);
+				if (bRead && !patch.add(wave->second, nOffset, dAmplitude, dDepth, dCustom))
+					return false;
+			}
+			else
+				return false;
+
+			if (!bRead || !(line >> ws).eof())
+				return false;
+		}
+		return true;
+	}
+
+	bool load_patch(const string &sFileName, instrument_patch &patch)
+	{
+		ifstream file(sFileName);
+		return file.is_open() && parse_patch(file, patch);
+	}
+
+	// Builds a patch from built-in text
+	instrument_patch patch(const char *sText)
+	{
+		instrument_patch p;
+		istringstream in(sText);
+		parse_patch(in, p);
+		return p;
+	}
+
+	// Built-in patches, the former hand-written instruments
+
+	const char *PATCH_BELL = R"(
+		name Bell
+		volume 1.0
+		lifetime 3.0
+		lfo 5.0
+		attack 0.01
+		decay 1.0
+		sustain 0.0
+		release 1.0
+		sine 12 1.00 0.001
+		bank 24 0.50
+		bank 36 0.25
+	)";
+
+	const char *PATCH_BELL8 = R"(
+		name 8-Bit Bell
+		volume 1.0
+		lifetime 3.0
+		lfo 5.0
+		attack 0.01
+		decay 0.5
+		sustain 0.8
+		release 1.0
+		square 0 1.00 0.001
+		bank 12 0.50
+		bank 24 0.25
+	)";
+
+	const char *PATCH_HARMONICA = R"(
+		name Harmonica
+		volume 0.3
+		lifetime -1.0
+		lfo 5.0
+		attack 0.0
+		decay 1.0
+		sustain 0.95
+		release 0.5
+		saw_ana -12 -1.00 0.001 100	# Saw ran on reversed time, which inverts it
+		square 0 1.00 0.001
+		square 12 0.50
+		noise 24 0.05
+	)";
+
+	const char *PATCH_DRUMKICK = R"(
+		name Drum Kick
+		volume 1.0
+		lifetime 1.5
+		limited 1
+		lfo 1.0
+		attack 0.01
+		decay 0.15
+		sustain 0.0
+		release 0.0
+		sine -36 0.99 1.0
+		noise 0 0.01
+	)";
+
+	const char *PATCH_DRUMSNARE = R"(
+		name Drum Snare
+		volume 1.0
+		lifetime 1.0
+		limited 1
+		lfo 0.5
+		attack 0.0
+		decay 0.2
+		sustain 0.0
+		release 0.0
+		sine -24 0.5 1.0
+		noise 0 0.5
+	)";
+
+	const char *PATCH_DRUMHIHAT = R"(
+		name Drum HiHat
+		volume 0.5
+		lifetime 1.0
+		limited 1
+		lfo 1.5
+		attack 0.01
+		decay 0.05
+		sustain 0.0
+		release 0.0
+		square -12 0.1 1.0
+		noise 0 0.9
+	)";
+
 
 	struct sequencer
 	{
@@ -436,79 +2624,183 @@ namespace synth
 	
 }
 
-vector<synth::note> vecNotes;
-synth::instrument_bell instBell;
-synth::instrument_harmonica instHarm;
-synth::instrument_drumkick instKick;
-synth::instrument_drumsnare instSnare;
-synth::instrument_drumhihat instHiHat;
-
-typedef bool(*lambda)(synth::note const& item);
-template<class T>
-void safe_remove(T &v, lambda f)
+synth::voice_pool voices;		// Owned by the audio thread
+synth::event_queue events;		// From the input loop to the audio thread
+synth::render_pool renderers;	// Renders the voices for the audio thread
+synth::instrument_patch instBell = synth::patch(synth::PATCH_BELL);
+synth::instrument_patch instHarm = synth::patch(synth::PATCH_HARMONICA);
+synth::instrument_patch instKick = synth::patch(synth::PATCH_DRUMKICK);
+synth::instrument_patch instSnare = synth::patch(synth::PATCH_DRUMSNARE);
+synth::instrument_patch instHiHat = synth::patch(synth::PATCH_DRUMHIHAT);
+
+// Renders the voices at nOrder[first, last) into pOutput, flagging those that
+// finish in bFinished
+void RenderVoices(int first, int last, FTYPE dTime, FTYPE dTimeStep, FTYPE *pOutput, int nSamples, bool *bFinished)
 {
-	auto n = v.begin();
-	while (n != v.end())
-		if (!f(*n))
-			n = v.erase(n);
-		else
-			++n;
+	// One instrument's run at a time. The instrument type is resolved once per
+	// run per block, then its voices render with direct calls.
+	for (int end; first < last; first = end)
+	{
+		int i = voices.nInstrument[voices.nOrder[first]];
+		for (end = first + 1; end < last && voices.nInstrument[voices.nOrder[end]] == i; end++);
+
+		visit([&](auto *inst)
+		{
+			for (int j = first; j < end; j++)
+			{
+				int v = voices.nOrder[j];
+				synth::voice n = voices[v];
+
+				// Retire voices that are silent for the rest of their life without rendering them
+				if (inst->finished(n, dTime, dTimeStep))
+					bFinished[v] = true;
+				else if (voices.nFade[v] > 0) // Stolen, so faded out over its last blocks
+				{
+					FTYPE dSound[synth::BLOCK_SIZE] = {};
+					bool bEnded = inst->sound_block(dTime, dTimeStep, n, dSound, nSamples) >= 0;
+					bFinished[v] = voices.fade(v, dSound, pOutput, nSamples) || bEnded;
+				}
+				else
+					bFinished[v] = inst->sound_block(dTime, dTimeStep, n, pOutput, nSamples) >= 0;
+			}
+		}, voices.pInstruments[i]->self);
+	}
 }
 
 // Function used by olcNoiseMaker to generate sound waves
-// Returns amplitude (-1.0 to +1.0) as a function of time
-FTYPE MakeNoise(FTYPE dTime)
+// Writes nSamples of amplitude (-1.0 to +1.0), starting at dTime, to pOutput
+void MakeNoise(FTYPE dTime, FTYPE dTimeStep, FTYPE *pOutput, int nSamples)
 {	
-	FTYPE dMixedOutput = 0.0;
-
-	// Iterate through all active notes, and mix together
-	for (auto &n : vecNotes)
+	// Mix together all voices, a partition at a time on the render threads
+	bool bFinished[synth::MAX_VOICES];
+	int nGranularity = renderers.nGranularity;
+	int nPartitions = (voices.nVoices + nGranularity - 1) / nGranularity;
+	renderers.run(nPartitions, [&](int p)
 	{
-		bool bNoteFinished = false;
-		FTYPE dSound = 0;
-
-		// Get sample for this note by using the correct instrument and envelope
-		if(n.channel != nullptr)
-			dSound = n.channel->sound(dTime, n, bNoteFinished);
-		
-		// Mix into output
-		dMixedOutput += dSound;
-
-		if (bNoteFinished) // Flag note to be removed
-			n.active = false;
+		FTYPE *pMix = renderers.mix(p);
+		fill(pMix, pMix + nSamples, 0.0);
+		RenderVoices(p * nGranularity, min(voices.nVoices, (p + 1) * nGranularity), dTime, dTimeStep, pMix, nSamples, bFinished);
+	});
+	voices.remove(bFinished);
+
+	// Always summed in partition order, so the result does not depend on the threads
+	fill(pOutput, pOutput + nSamples, 0.0);
+	for (int p = 0; p < nPartitions; p++)
+	{
+		const FTYPE *pMix = renderers.mix(p);
+		for (int i = 0; i < nSamples; i++)
+			pOutput[i] += pMix[i];
 	}
-	// Woah! Modern C++ Overload!!! Remove notes which are now inactive
-	safe_remove<vector<synth::note>>(vecNotes, [](synth::note const& item) { return item.active; });
-	return dMixedOutput * 0.2;
+
+	for (int i = 0; i < nSamples; i++)
+		pOutput[i] *= 0.2;
 }
 
 struct Data {
     uint64_t sampleCount = 0;
-    double time = 0.0;
+
+    // Output sample at SDL tick 0, so that an event at SDL tick t is due at sample
+    // tickOrigin + t * SAMPLE_RATE / 1000. Set by the audio callback.
+    std::atomic<double> tickOrigin { 0.0 };
+
+    // Event taken from the queue that is not due yet, audio thread only
+    synth::note_event pending;
+    bool hasPending = false;
 };
 
+// Output sample an SDL event timestamp is due at
+int64_t eventSample(const Data& data, Uint32 timestamp) {
+    return (int64_t)(data.tickOrigin.load() + timestamp * (synth::SAMPLE_RATE / 1000.0));
+}
+
 void audioCallback(void* userdata, uint8_t* stream, int length) {
     Data* data = (Data*) userdata;
     uint64_t* sampleCount = &data->sampleCount;
     float* fstream = (float*) stream;
 
-    for (int sid = 0; sid < length / 8; ++sid) {
-        double time = (*sampleCount + sid) / 44100.0;
-        data->time = time;
-        double value = MakeNoise(time);
+    FTYPE block[synth::BLOCK_SIZE];
+    int frames = length / 8;
 
+    // Events from now on are played from the start of the next buffer, keeping
+    // the spacing they had as input at a constant latency of one buffer
+    data->tickOrigin = *sampleCount + frames - SDL_GetTicks() * (synth::SAMPLE_RATE / 1000.0);
 
-        fstream[2 * sid + 0] = value;
-        fstream[2 * sid + 1] = value;
+    for (int sid = 0; sid < frames;) {
+        int64_t now = *sampleCount + sid;
+
+        // Apply the events due by now
+        while (data->hasPending || (data->hasPending = events.pop(data->pending))) {
+            if (data->pending.nSample > now)
+                break;
+            int v = voices.apply(data->pending);
+            if (v >= 0)
+                synth::renders.attach(voices, v);
+            data->hasPending = false;
+        }
+
+        // Render up to the next event, so that it starts on its exact sample
+        int count = min(synth::BLOCK_SIZE, frames - sid);
+        if (data->hasPending && data->pending.nSample < now + count)
+            count = (int)(data->pending.nSample - now);
+
+        MakeNoise(now / synth::SAMPLE_RATE, 1.0 / synth::SAMPLE_RATE, block, count);
+
+        for (int i = 0; i < count; ++i) {
+            fstream[2 * (sid + i) + 0] = block[i];
+            fstream[2 * (sid + i) + 1] = block[i];
+        }
+
+        sid += count;
     }
 
     *sampleCount += length / 8;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
     Data data;
     bool isActive = true;
 
+    // Options: -t <render threads> -g <voices per render partition> -s <Scala scale file>
+    const char* scaleFile = nullptr;
+    int arg = 1;
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+        int value = atoi(argv[arg + 1]);
+
+        if (strcmp(argv[arg], "-t") == 0 && value > 0) {
+            renderers.start(value);
+        } else if (strcmp(argv[arg], "-g") == 0 && value > 0) {
+            renderers.nGranularity = value;
+        } else if (strcmp(argv[arg], "-s") == 0) {
+            scaleFile = argv[arg + 1];
+        } else {
+            std::cout << "Usage: " << argv[0] << " [-t threads] [-g voices per partition] [-s scale.scl] [patch file]" << std::endl;
+
+            return -1;
+        }
+    }
+
+    // The keyboard plays the harmonica, or the patch file given on the command line
+    if (arg < argc && !synth::load_patch(argv[arg], instHarm)) {
+        std::cout << "Cannot load patch: " << argv[arg] << std::endl;
+
+        return -1;
+    }
+
+    // A scale file retunes the keyboard, with its degree 0 on the first key at its 12-TET pitch
+    if (scaleFile) {
+        synth::tuning scale;
+        int scaleId = -1;
+        if (synth::load_scala(scaleFile, scale, synth::DEFAULT_TUNING.hertz(64), 64))
+            scaleId = synth::add_scale(scale);
+
+        if (scaleId < 0) {
+            std::cout << "Cannot load scale: " << scaleFile << std::endl;
+
+            return -1;
+        }
+        instHarm.nScale = scaleId;
+    }
+
     if (SDL_Init(SDL_INIT_AUDIO) != 0) {
         std::cout << "SDL error: " << SDL_GetError() << std::endl;
 
@@ -527,6 +2819,7 @@ int main() {
     audioSpecDesired.userdata = (void*) &data;
 
     SDL_AudioDeviceID audioDeviceId = SDL_OpenAudioDevice(NULL, 0, &audioSpecDesired, &audioSpecObtained, SDL_AUDIO_ALLOW_ANY_CHANGE);
+    data.tickOrigin = -(SDL_GetTicks() * (synth::SAMPLE_RATE / 1000.0));
     SDL_PauseAudioDevice(audioDeviceId, 0);
 
     std::vector<SDL_Scancode> notes = {
@@ -539,50 +2832,42 @@ int main() {
         SDL_SCANCODE_M
     };
 
+    // Note ID each scancode plays, or -1
+    int keyNotes[SDL_NUM_SCANCODES];
+    std::fill(keyNotes, keyNotes + SDL_NUM_SCANCODES, -1);
+    for (int k = 0; k < (int)notes.size(); ++k)
+        keyNotes[notes[k]] = k + 64;
+
 
     while (isActive) {
         SDL_Event event;
-double time = data.time;
         while (SDL_PollEvent(&event)) {
             if (event.type == SDL_QUIT) {
                 isActive = false;
             }
             
-            for (int k = 0; k < notes.size(); ++k) {
-                auto noteFound = find_if(vecNotes.begin(), vecNotes.end(), [&k](synth::note const& item) { return item.id == k+64 && item.channel == &instHarm; });
-                SDL_Scancode code = notes[k];
-
-                if (event.type == SDL_KEYDOWN && event.key.keysym.scancode == code && event.key.repeat == 0) {
-                    if (noteFound == vecNotes.end()) {
-                        synth::note n;
-                        n.id = k + 64;
-                        n.on = time;
-                        n.active = true;
-                        n.channel = &instHarm;
-
-                        // Add note to vector
-                        vecNotes.emplace_back(n);
-                    } else {
-                        if (noteFound->off > noteFound->on)
-                        {
-                            // Key has been pressed again during release phase
-                            noteFound->on = time;
-                            noteFound->active = true;
-                        }
-                    }
+            if ((event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) && keyNotes[event.key.keysym.scancode] >= 0) {
+                int id = keyNotes[event.key.keysym.scancode];
+
+                if (event.type == SDL_KEYDOWN && event.key.repeat == 0) {
+                    events.push({ synth::EVENT_NOTE_ON, &instHarm, id, eventSample(data, event.key.timestamp) });
                 }
 
-                if (event.type == SDL_KEYUP && event.key.keysym.scancode == code) {
-                        if (noteFound->off < noteFound->on)
-                            noteFound->off = time;
+                if (event.type == SDL_KEYUP) {
+                    events.push({ synth::EVENT_NOTE_OFF, &instHarm, id, eventSample(data, event.key.timestamp) });
                 }
             }
-
-
         }
     }
 
     SDL_CloseAudioDevice(audioDeviceId);
+    synth::renders.stop();
+
+    const synth::render_cache& cache = synth::renders.cache;
+    std::cout << "Render cache: " << cache.nHits << " hits, " << cache.nMisses << " misses, "
+        << cache.nEvictions << " evictions, " << cache.nBytes << " bytes" << std::endl;
+    std::cout << "Voices: " << voices.nPeak << " of " << voices.nMaxVoices << " at peak, " << voices.nStarted << " started, "
+        << voices.nStolen << " stolen, " << voices.nRejected << " rejected" << std::endl;
     SDL_DestroyWindow(window);
     SDL_Quit();
 